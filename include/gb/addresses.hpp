@@ -32,6 +32,13 @@ namespace gb {
 			transferControl = 0xFF02
 		};
 
+		enum Timer : Address {
+			div = 0xFF04,		//Increments at 16384 Hz
+			tima,				//Increments at the frequency selected by tac
+			tma,				//Loaded into tima when it overflows
+			tac					//Timer enable (0x4) and frequency (0x3)
+		};
+
 		enum Sound : Address {
 
 			sweep1 = 0xFF10,
@@ -54,6 +61,7 @@ namespace gb {
 			length4 = 0xFF20,
 			volume4,
 			polynomialCounter4,
+			counter4,
 
 			channelControl,
 			soundOutputTerminal,
@@ -0,0 +1,102 @@
+#pragma once
+#include "gb/emulator.hpp"
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+namespace gb {
+
+	//Runs many independent emulators on all cores
+	//Every worker has its own queue of instances and steals from the back of the others once it runs dry
+	//Instances run in slices, so a long run can still be spread over workers that finished early
+
+	struct Batch {
+
+		//Called on a worker thread once an instance finished its run
+
+		using Callback = std::function<void(usz id, Emulator &emu)>;
+
+		struct Info {
+
+			usz threads = 0;							//0 = one per hardware thread
+			u64 sliceFrames = 60;						//Frames an instance runs before it goes back to a queue
+
+			Emulator::CpuMode cpuMode = Emulator::INTERPRETER;
+			u32 renderEvery = 1;						//Emulator::renderEvery; 0 runs without rendering
+
+			//Pin worker i to core i
+			//Instances are created by the worker that first runs them, so their memory ends up on its NUMA node
+
+			bool pinThreads = false;
+		};
+
+		Batch();
+		explicit Batch(const Info &info);
+		~Batch();
+
+		Batch(const Batch&) = delete;
+		Batch &operator=(const Batch&) = delete;
+
+		//Instances are created at the start of their first run
+
+		//Every instance reads the same ROM image (RomCache), it isn't copied per instance
+
+		usz add(const Buffer &rom, const Buffer &bios = {}, Callback onComplete = {});
+		usz add(std::shared_ptr<const RomImage> rom, std::shared_ptr<const RomImage> bios = {}, Callback onComplete = {});
+
+		//Advance every instance and wait until all of them are done
+
+		void runFrames(u64 frames);
+		void runCycles(u64 cycles);
+
+		usz size() const { return instances.size(); }
+		usz threads() const { return workers.size(); }
+
+		//nullptr until the instance ran for the first time
+
+		Emulator *operator[](usz id) { return instances[id]->emu.get(); }
+
+	private:
+
+		struct Instance {
+			std::shared_ptr<const RomImage> rom, bios;
+			Callback onComplete;
+			std::unique_ptr<Emulator> emu;
+			u64 left{};									//Frames or cycles left in this run
+		};
+
+		struct Worker {
+			std::mutex lock;
+			std::deque<usz> queue;
+			std::thread thread;
+		};
+
+		void run(u64 amount, bool frames);
+		void work(usz worker);
+
+		bool pop(usz worker, usz &id);
+		void push(usz worker, usz id);
+
+		bool runSlice(Instance &instance);
+
+		Info info;
+
+		List<std::unique_ptr<Instance>> instances;
+		List<std::unique_ptr<Worker>> workers;
+
+		//ready wakes idle workers once something is queued or the run is over
+
+		std::mutex lock;
+		std::condition_variable start, ready, done;
+
+		u64 round{};
+		bool runsFrames{}, stopping{};
+
+		std::atomic<usz> remaining{}, queued{};
+	};
+
+}
@@ -0,0 +1,57 @@
+#pragma once
+#include "types/types.hpp"
+
+namespace gb {
+
+	struct Emulator;
+
+	//Handler of a single instruction
+	//Called with pc pointing after the opcode (and CB prefix), just like op256/opCb
+
+	using OpHandler = usz (*)(Emulator&);
+
+	struct DecodedOp {
+		OpHandler handler;
+		u8 prefix;				//Opcode bytes consumed before calling the handler (1 or 2 with CB)
+	};
+
+	//Straight-line code decoded once; ends at the first branch or after maxOps
+
+	struct Block {
+
+		static constexpr usz maxOps = 24;
+
+		static constexpr u32 invalidKey = u32_MAX;
+
+		u32 key = invalidKey;			//(bank << 16) | address
+		u32 gen{};						//Write generation of the code page when decoded
+
+		const u32 *genPtr{};			//Write generation to check against (constant for ROM)
+
+		u8 count{};
+		DecodedOp ops[maxOps];
+	};
+
+	//Direct mapped cache of blocks, keyed by bank and address
+
+	struct BlockCache {
+
+		static constexpr usz entries = 2048;
+
+		List<Block> blocks;
+
+		_inline_ Block &find(u32 key) {
+
+			if (blocks.empty())
+				blocks.resize(entries);
+
+			return blocks[(key ^ (key >> 13) ^ (key >> 16)) & (entries - 1)];
+		}
+
+		_inline_ void clear() {
+			for (Block &b : blocks)
+				b.key = Block::invalidKey;
+		}
+	};
+
+}
@@ -0,0 +1,198 @@
+
+namespace gb {
+
+	//Info needed to walk over straight-line code
+	//Lengths are what the handlers in cpu.inc.hpp consume, not what the hardware does
+
+	struct OpInfo {
+		u8 length;
+		bool ends;			//Changes control flow or interrupt state; ends a block
+		bool valid;			//Undefined opcodes are left to the interpreter
+	};
+
+	template<u8 i>
+	static constexpr OpInfo opInfo() {
+
+		constexpr u8 code = i & 0x07, hi = i & 0xF;
+
+		constexpr bool valid = !(
+			i == 0xD3 || i == 0xDB || i == 0xDD || i == 0xE3 || i == 0xE4 || i == 0xE8 ||
+			i == 0xEB || i == 0xEC || i == 0xED || i == 0xF4 || i == 0xF9 || i == 0xFC || i == 0xFD
+		);
+
+		constexpr bool ends =
+			isJump<i, code, hi> || (i >= 0xC0 && code == 7) ||		//Branches and RST
+			i == HALT || i == STOP || i == DI || i == EI;
+
+		constexpr bool jpOrCall = i >= 0xC0 && i < 0xE0 && (code == 2 || code == 4 || i == 0xC3 || i == 0xCD);
+
+		if constexpr ((i < 0x40 && hi == 1) || i == 0x08 || i == 0xEA || i == 0xFA || jpOrCall)
+			return { 3, ends, valid };
+
+		else if constexpr (code == 6 && (i < 0x40 || i >= 0xC0))
+			return { 2, ends, valid };
+
+		else if constexpr (i == 0xE0 || i == 0xF0 || i == 0xF8 || i == 0xCB || (i < 0x40 && isJump<i, code, hi>))
+			return { 2, ends, valid };
+
+		else return { 1, ends, valid };
+	}
+
+	//Handlers called through a function pointer
+
+	template<u8 c> usz Emulator::decodedOp(Emulator &e) { return e.op256<c>(); }
+	template<u8 c> usz Emulator::decodedCb(Emulator &e) { return e.opCb<c>(); }
+
+	//For our tables of 256 entries
+	#define list1(x,y) y(x),
+	#define list2(x,y) list1(x,y) list1(x + 1,y)
+	#define list4(x,y) list2(x,y) list2(x + 2,y)
+	#define list8(x,y) list4(x,y) list4(x + 4,y)
+	#define list16(x,y) list8(x,y) list8(x + 8,y)
+	#define list32(x,y) list16(x,y) list16(x + 16,y)
+	#define list64(x,y) list32(x,y) list32(x + 32,y)
+	#define list128(x,y) list64(x,y) list64(x + 64,y)
+	#define list256(y) list128(0,y) list128(128,y)
+
+	#define opInfoEntry(x) opInfo<x>()
+	#define opHandlerEntry(x) &Emulator::decodedOp<x>
+	#define cbHandlerEntry(x) &Emulator::decodedCb<x>
+
+	static constexpr OpInfo opInfos[256] = { list256(opInfoEntry) };
+
+	static constexpr u32 romGen{};
+
+	//Blocks are keyed by address and the bank that is mapped there
+
+	_inline_ u32 Emulator::blockKey() {
+
+		if (pc < MemoryMapper::biosLength && getFlag<Emulator::IS_IN_BIOS>())
+			return 0xFFFF0000 | pc;
+
+		switch (pc >> 13) {
+
+			case 0: case 1:		//ROM #0 (switchable on MBC1)
+				return u32((m.getMemory<u64>(Emulator::MBC_ROM0 >> 8) - MemoryMapper::romStart) >> 14) << 16 | pc;
+
+			case 2: case 3:		//ROM #n
+				return u32(((m.getMemory<u64>(Emulator::MBC_ROM >> 8) - MemoryMapper::romStart) >> 14) + 1) << 16 | pc;
+
+			case 5:				//Cartridge RAM
+				return u32(0x8000 | u8(m.getMemory<u64>(Emulator::MBC_RAM >> 8) >> 13)) << 16 | pc;
+
+			default:
+				return pc;
+		}
+	}
+
+	//Decode straight-line code at pc into the block
+
+	_inline_ Block *Emulator::decodeBlock(Block &block, u32 key) {
+
+		static constexpr OpHandler opHandlers[256] = { list256(opHandlerEntry) };
+		static constexpr OpHandler cbHandlers[256] = { list256(cbHandlerEntry) };
+
+		const bool inRam = pc >= 0x8000;
+
+		//Blocks can't cross the end of the BIOS, a bank or a RAM page (generations are per page)
+
+		const u32 end =
+			key >> 16 == 0xFFFF ? u32(MemoryMapper::biosLength) :
+			inRam ? u32(pc | 0xFF) + 1 :
+			u32(pc | 0x3FFF) + 1;
+
+		//Code in RAM is checked against the write generation of its page
+		//ROM #n is checked against the bank offset, so switching banks stops the block
+
+		if (inRam)
+			block.genPtr = &m.getMemory<u32>(MemoryMapper::codeGenStart + usz((pc >> 8) - 0x80) * sizeof(u32));
+
+		else if (pc >= 0x4000)
+			block.genPtr = &m.getMemory<u32>(Emulator::MBC_ROM >> 8);
+
+		else if (key >> 16 != 0xFFFF)
+			block.genPtr = &m.getMemory<u32>(Emulator::MBC_ROM0 >> 8);
+
+		else block.genPtr = &romGen;
+
+		block.key = key;
+		block.gen = *block.genPtr;
+		block.count = 0;
+
+		u32 addr = pc;
+
+		while (block.count < Block::maxOps) {
+
+			const u8 opCode = m[u16(addr)];
+			const OpInfo info = opInfos[opCode];
+
+			if (!info.valid || addr + info.length > end)
+				break;
+
+			if (opCode == 0xCB)
+				block.ops[block.count++] = { cbHandlers[u8(m[u16(addr + 1)])], 2 };
+			else
+				block.ops[block.count++] = { opHandlers[opCode], 1 };
+
+			addr += info.length;
+
+			if (info.ends)
+				break;
+		}
+
+		if (!block.count) {
+			block.key = Block::invalidKey;
+			return nullptr;
+		}
+
+		return &block;
+	}
+
+	//Find the block at pc, decoding it if it wasn't cached yet
+
+	_inline_ Block *Emulator::findBlock() {
+
+		if (pc >= MemoryMapper::biosLength && getFlag<Emulator::IS_IN_BIOS>())
+			MemoryMapper::unmapBios(&m);
+
+		const u32 key = blockKey();
+		Block &block = blockCache.find(key);
+
+		if (block.key != key || *block.genPtr != block.gen)
+			return decodeBlock(block, key);
+
+		return &block;
+	}
+
+	//Run a block of cached instructions, until it ends or the budget is used up
+
+	_inline_ usz Emulator::runBlock(const Block &block, usz budget) {
+
+		const u8 &pending = m.getMemory<u8>(Emulator::SCHEDULE >> 8);
+		usz cycles{};
+
+		for (const DecodedOp *op = block.ops, *end = op + block.count; op != end; ++op) {
+
+			pc += op->prefix;
+			cycles += op->handler(*this);
+
+			//Code was modified or the scheduler has to run
+
+			if (cycles >= budget || *block.genPtr != block.gen || pending)
+				break;
+		}
+
+		return cycles;
+	}
+
+	_inline_ usz Emulator::blockStep(usz budget) {
+
+		//Undefined ops are handled by the interpreter
+
+		if (const Block *block = findBlock())
+			return runBlock(*block, budget);
+
+		return cpuStep();
+	}
+
+}
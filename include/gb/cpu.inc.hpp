@@ -1,11 +1,18 @@
 
 namespace gb {
 
+	template<u8 c, u8 start, u8 end>
+	static constexpr bool inRegion = c >= start && c < end;
+
 	//Debugging
 
 	template<bool isCb, typename ...args>
 	_inline_ void Emulator::operation(const args &...arg) {
-		oic::System::log()->debug(oic::Log::concat(std::hex, arg...), "\t\t; $", oic::Log::concat(std::hex, pc - 1 - isCb));
+		#ifdef __PRINT_INSTRUCTIONS__
+			oic::System::log()->debug(oic::Log::concat(std::hex, arg...), "\t\t; $", oic::Log::concat(std::hex, pc - 1 - isCb));
+		#else
+			((void)arg, ...);
+		#endif
 	}
 
 	const char *crName[] = { "b", "c", "d", "e", "h", "l", "(hl)", "a" };
@@ -18,7 +25,6 @@ namespace gb {
 	//Function for setting a cr
 
 	template<u8 cr, typename T> _inline_ void Emulator::set(const T &t) {
-		m;
 		if constexpr (cr != 6) regs[registerMapping[cr]] = t;
 		else m.set(hl, t);
 	}
@@ -31,8 +37,6 @@ namespace gb {
 
 	template<u8 cr, typename T> _inline_ T Emulator::get() {
 
-		m;
-
 		if constexpr (cr == 6)
 			return m.get<T>(hl);
 
@@ -51,15 +55,25 @@ namespace gb {
 
 	//Special instructions
 
+	//HALT and STOP stop the cpu until they're woken up by the interrupt handler
+	//Until then, cpuRun skips straight to the next event
+
 	_inline_ usz Emulator::halt() {
-		//TODO: HALT
+
 		operation("halt");
+
+		setFlag<true, Emulator::IS_HALTED>();
+		setFlag<true, Emulator::CHECK_INTERRUPTS>();
 		return 1;
 	}
 
 	_inline_ usz Emulator::stop() {
-		//TODO: Stop
+
 		operation("stop");
+
+		setFlag<true, Emulator::IS_HALTED>();
+		setFlag<true, Emulator::IS_STOPPED>();
+		setFlag<true, Emulator::CHECK_INTERRUPTS>();
 		return 1;
 	}
 
@@ -283,8 +297,10 @@ namespace gb {
 
 			Stack::pop(m, sp, pc);
 
-			if constexpr ((jp & 8) != 0)			//RETI
+			if constexpr ((jp & 8) != 0) {			//RETI
 				setFlag<true, Emulator::IME>();
+				setFlag<true, Emulator::CHECK_INTERRUPTS>();
+			}
 
 			return check == 0 ? 4 : 5;
 		}
@@ -307,8 +323,17 @@ namespace gb {
 
 		//JR
 		else {
-			pc += u16(i16(m.get<i8>(pc)));
+
+			const i8 offset = m.get<i8>(pc);
+			pc += u16(i16(offset));
 			++pc;
+
+			//Tight conditional loops might just be waiting for an event
+
+			if constexpr (check != 0)
+				if (offset == -6 || offset == -7)
+					detectIdleLoop();
+
 			return 3;
 		}
 	}
@@ -392,9 +417,6 @@ namespace gb {
 
 	//Every case runs through this
 
-	template<u8 c, u8 start, u8 end>
-	static constexpr bool inRegion = c >= start && c < end;
-
 	template<u8 c, u8 code, u8 hi>
 	static constexpr bool isJump =
 		(inRegion<c, 0x18, 0x40> && code == 0) ||	//JR
@@ -423,7 +445,7 @@ namespace gb {
 			f.clearSubtract();
 			f.clearHalf();
 
-			u8 i = get<cr, u8>(), j = i; j;
+			u8 i = get<cr, u8>(), j = i; (void)j;
 
 			//RLC (rotate to the left)
 
@@ -542,6 +564,10 @@ namespace gb {
 		else if constexpr (i == DI || i == EI) {
 			operation(i == DI ? "di" : "ei");
 			setFlag<i == EI, Emulator::IME>();
+
+			if constexpr (i == EI)
+				setFlag<true, Emulator::CHECK_INTERRUPTS>();
+
 			return 1;
 		}
 
@@ -770,11 +796,8 @@ namespace gb {
 
 	_inline_ usz Emulator::cpuStep() {
 		
-		u8 &mem = m.getMemory<u8>(Emulator::IS_IN_BIOS >> 8);
-		constexpr u8 bit = Emulator::IS_IN_BIOS & 0xFF;
-
-		if (mem & bit && pc >= MemoryMapper::biosLength)
-			mem &= ~bit;
+		if (pc >= MemoryMapper::biosLength && getFlag<Emulator::IS_IN_BIOS>())
+			MemoryMapper::unmapBios(&m);
 
 		u8 opCode = m[pc];
 		print(std::hex, pc, ' ', u16(opCode), '\t');
@@ -804,6 +827,22 @@ namespace gb {
 
 		usz counter {};
 
+		//Requested interrupts wake up HALT, even if IME is off
+		//Those are raised by the scheduler: vblank and STAT (mode, LY=LYC) from the PPU events, timer, serial and joypad
+		//STOP is only woken up by the joypad
+
+		if (getFlag<Emulator::IS_HALTED>()) {
+
+			const u8 requested = m.getRef<u8>(io::IF);
+
+			if (getFlag<Emulator::IS_STOPPED>() ? !(requested & 0x10) : !(requested & m.getRef<u8>(io::IE) & 0x1F))
+				return 0;
+
+			setFlag<false, Emulator::IS_HALTED>();
+			setFlag<false, Emulator::IS_STOPPED>();
+			++counter;
+		}
+
 		if (getFlag<Emulator::IME>()) {
 
 			u8 &u = m.getRef<u8>(io::IF);
@@ -0,0 +1,26 @@
+#pragma once
+#include "types/types.hpp"
+
+namespace gb {
+
+	//Compressed XOR of two buffers of the same size, as runs and literals
+	//Unchanged bytes XOR to long runs of 0, so consecutive states of an emulator compress well
+
+	namespace delta {
+
+		//Maximum size of the compressed data
+
+		usz bound(usz size);
+
+		//Compress a ^ base into out (at least bound(size) bytes); a base of nullptr compresses a itself
+		//Returns the compressed size
+
+		usz compress(const u8 *a, const u8 *base, usz size, u8 *out);
+
+		//XOR the compressed data into dst (dstSize bytes); into zeroes for data compressed without base
+		//Returns false if the data is cut off or doesn't cover exactly dstSize bytes; dst can be partly changed then
+
+		bool apply(const u8 *in, usz size, u8 *dst, usz dstSize);
+	}
+
+}
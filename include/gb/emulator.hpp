@@ -1,62 +1,273 @@
 #pragma once
-#include "emu/memory.hpp"
-#include "emu/stack.hpp"
 #include "gb/psr.hpp"
 #include "gb/addresses.hpp"
+#include "gb/block_cache.hpp"
+#include "gb/scheduler.hpp"
+#include "gb/tile_cache.hpp"
+#include "gb/pixels.hpp"
+#include "gb/rom_cache.hpp"
+#include "gb/frame_ring.hpp"
 #include "types/grid.hpp"
+#include <memory>
 
 namespace gb {
 
-	struct MemoryMapper;
-
-	using Memory = emu::Memory16<MemoryMapper>;
-	using Stack = emu::Stack<Memory, u16>;
+	struct Memory;
 
 	struct MemoryMapper {
 
 		static constexpr usz
 
+			//Packed per instance; the fixed part is ~72 KiB and the RAM banks are sized by the cartridge header (0x149)
+			//The MMU variables directly follow OAM, I/O and HRAM ([0xFE00, 0x10000>), so the hot state is in a few cache lines
+
 			cpuStart = 0x10000,
 			cpuLength = 0x10000,		//64 KiB of CPU accessible memory
-			mapping = cpuStart,			//Map the cpu memory to our memory space
+			mapping = cpuStart,			//Map the cpu memory to our memory space; 64 KiB aligned, so addresses can be or'ed in
 
-			ramStart = 0x40000,
-			ramLength = 0x10000,		//64 KiB of RAM banks max
+			mmuStart = cpuStart + cpuLength,
+			mmuLength = 64,						//The MMU's variables, as well as IME
 
-			romStart = ramStart + ramLength,
-			romLength = 0x200000,		//2 MiB of ROM banks max
+			controllerStart = mmuStart + mmuLength,			//Handlers of the memory bank controller
+			controllerLength = 3 * sizeof(u64),				//Host function pointers, so not part of a save state
 
-			biosStart = romStart + romLength,
-			biosLength = 256,
+			codeGenStart = controllerStart + controllerLength,	//Write generation per 256 byte page of [0x8000, 0x10000>
+			codeGenLength = 0x80 * sizeof(u32),		//Used by the block cache to detect modified code
+
+			readPages = codeGenStart + codeGenLength,	//Host offset per 256 byte page; read from offset + address
+			writePages = readPages + 256 * sizeof(u64),	//Same for writes; 0 if the page needs a handler
+			pagesLength = 2 * 256 * sizeof(u64),
 
-			mmuStart = biosStart + 0x10000,		//Align better
-			mmuLength = 32,						//The MMU's variables, as well as IME
+			ramStart = 0x22000,
+			ramLength = 0x20000,		//128 KiB of RAM banks max (MBC5); only the banks of the cartridge are allocated
+
+			dirtyStart = readPages + pagesLength,				//Written flag per 256 byte page of [cpuStart, ramStart + ramLength>
+			dirtyLength = (ramStart + ramLength - cpuStart) >> 8,	//Used by save states to only store what changed
 
 			memStart = cpuStart,
-			memLength = (mmuStart + mmuLength) - cpuStart;
+			memLength = ramStart - cpuStart,		//Without the RAM banks
+
+			//Read-only; not part of the allocation of an instance, but shared by all of its forks
+
+			romStart = 0x1000000,
+			romLength = 0x800000,		//8 MiB of ROM banks max (MBC5)
+
+			biosStart = romStart + romLength,
+			biosLength = 256;
 
 		template<typename T>
 		static _inline_ T read(Memory *m, u16 a);
 
-		static _inline_ void calculateRomOffset(Memory *m);
+		//Page table; only has to be updated when the memory map changes
+
+		static _inline_ void mapPages(Memory *m, usz table, u8 first, u8 last, u64 offset);
+
+		static _inline_ void mapRom(Memory *m);
+		static _inline_ void mapRam(Memory *m, bool mapped);
+		static _inline_ void initPages(Memory *m);
+
+		static _inline_ void unmapBios(Memory *m);
+
+		//Memory bank controller
+		//Handles writes to [0x0000, 0x8000> and external RAM pages that aren't in the page table
+
+		using ControllerWrite = void (*)(Memory *m, u16 a, u8 v);
+		using ControllerRead = u8 (*)(Memory *m, u16 a);
+		using ControllerMap = void (*)(Memory *m);
+
+		static _inline_ usz romBanks(const u8 *rom);
+		static _inline_ usz ramBanks(const u8 *rom);
+
+		static _inline_ void setRomBank(Memory *m, usz bank, usz rom0Bank = 0);
+		static _inline_ void setRamBank(Memory *m, usz bank, bool mapped);
+
+		template<typename Mbc>
+		static _inline_ void useController(Memory *m);
+
+		static _inline_ bool initController(Memory *m, const u8 *rom);
+
+		//Rebuild the page table from the MMU variables (after they were overwritten)
+
+		static _inline_ void remap(Memory *m);
+		static _inline_ void tickRtc(Memory *m);
+
+		template<typename T>
+		static _inline_ void invalidateCode(Memory *m, u16 a);
+
+		static _inline_ void markDirty(Memory *m, u64 host);
+
+		static _inline_ void updateJoypad(Memory *m);
+		static _inline_ void ioWrite(Memory *m, u16 a);
 
 		template<typename T>
 		static _inline_ void write(Memory *m, u16 a, const T &t);
 	};
 
+	//Address space of a single emulator
+	//Addresses follow the layout of the MemoryMapper, but are relative to an allocation per instance
+
+	struct Memory {
+
+		//Region of the layout; the ones with init data are copied in, the rest starts zeroed
+		//Read-only regions (ROM and BIOS) aren't allocated; they are read from the images of the RomCache
+
+		struct Range {
+			usz start, size;
+			bool writable;
+			const char *name, *desc;
+			Buffer init;
+		};
+
+		struct Proxy {
+
+			Memory *m;
+			u16 a;
+
+			_inline_ operator u8() const;
+
+			_inline_ Proxy &operator=(u8 v);
+			_inline_ u8 operator+=(u8 v);
+		};
+
+		Memory(const List<Range> &ranges, std::shared_ptr<const RomImage> rom, std::shared_ptr<const RomImage> bios);
+		explicit Memory(const Memory *parent);		//Fork; shares the read-only ranges and copies the rest
+		~Memory();
+
+		Memory(const Memory&) = delete;
+		Memory &operator=(const Memory&) = delete;
+
+		//Through the memory mapper
+
+		template<typename T> _inline_ T get(u16 a) { return MemoryMapper::read<T>(this, a); }
+		template<typename T> _inline_ void set(u16 a, const T &t) { MemoryMapper::write<T>(this, a, t); }
+
+		_inline_ Proxy operator[](u16 a) { return Proxy{ this, a }; }
+
+		//Raw access to the cpu memory (no banking or side effects) and to the rest of the layout
+
+		template<typename T> _inline_ T &getRef(u16 a) { return getMemory<T>(MemoryMapper::mapping | a); }
+		template<typename T> _inline_ T &getMemory(usz a) { return *(T*)(base + a); }
+
+		usz size() const { return length; }
+
+		//Host address of an address in the layout
+
+		_inline_ u64 host(usz a) const {
+
+			if (a >= MemoryMapper::romStart)
+				return (a < MemoryMapper::biosStart ? romBase : biosBase) + a;
+
+			return base + a;
+		}
+
+		_inline_ const u8 *rom() const { return (const u8*) host(MemoryMapper::romStart); }
+
+	private:
+
+		u8 *data;			//Page aligned
+		u64 base;			//data - MemoryMapper::memStart
+		usz length;			//MemoryMapper::memLength and the RAM banks
+
+		List<Range> writable;
+
+		std::shared_ptr<const RomImage> romImage, biosImage;
+		u64 romBase, biosBase;						//Same as base, for the read-only ranges
+	};
+
+	struct Stack {
+		static _inline_ void push(Memory &m, u16 &sp, u16 v);
+		static _inline_ void pop(Memory &m, u16 &sp, u16 &v);
+	};
+
 	struct Emulator {
 
 		//Creation
 
 		Emulator(const Buffer &rom, const Buffer &bios);
+
+		//Runs straight from shared images (RomCache), the ROM isn't copied; bios can be null
+
+		Emulator(std::shared_ptr<const RomImage> rom, std::shared_ptr<const RomImage> bios);
 		~Emulator() = default;
 
+		//Start the cartridge without running the boot ROM; the registers and I/O get the state the DMG boot ROM leaves
+		//Done on creation when there's no BIOS, only valid before the first instruction ran
+
+		void skipBios();
+
+		//Fork; the child shares the ROM and BIOS and copies the registers, events and writable memory
+		//The block cache of the child starts out empty and the output isn't copied
+
+		std::unique_ptr<Emulator> fork() const;
+
 		//Emulation
 
 		void frame(const oic::Grid2D<u32> &buffer);
 		void frameNoSync(const oic::Grid2D<u32> &buffer);
 		void step(bool &pushScreen);
 
+		//Run for a number of machine cycles, regardless of frames (can overshoot by an instruction)
+
+		void run(u64 cycles);
+
+		//Output; RGBA goes to output, shades (0-3) go to a buffer of outputSize bytes the caller owns
+		//Packed shades are 4 pixels per byte, the leftmost in the lowest bits
+		//Lines that aren't drawn (LCD off) are shade 0, RGBA uses the OFF color
+		//shades isn't needed if frames go to frame buffers
+
+		enum OutputFormat : u8 {
+			OUTPUT_RGBA,
+			OUTPUT_SHADES,
+			OUTPUT_PACKED_SHADES
+		};
+
+		void setOutput(OutputFormat format, u8 *shades = nullptr);
+
+		static usz outputSize(OutputFormat format);
+
+		//Shades to RGBA for display; specs::width * specs::height pixels
+
+		static void expandShades(OutputFormat format, const u8 *shades, u32 *rgba);
+
+		//Frame buffers; frames are drawn straight into buffers the caller owns (outputSize(outputFormat) bytes each)
+		//A finished frame waits until it's acquired, then the buffer is the caller's until it's released
+		//If no buffer is free the oldest frame that wasn't acquired is drawn over, if all are acquired frames aren't drawn
+		//Acquire and release can be called from another thread; run and step draw to the output instead
+		//Setting 0 buffers goes back to the output
+
+		void setFrameBuffers(void *const *buffers, usz count);
+
+		//Oldest finished frame, nullptr if there's none
+		//changedLines gets the lines that differ from the frame acquired before it, so unchanged ones don't have to be uploaded
+
+		void *acquireFrame(LineMask *changedLines = nullptr);
+		void releaseFrame(void *buffer);
+
+		//Lines of the output that changed in the current frame, or in the last one once it reached vblank
+		//Reset when LY wraps to 0, so it's the same after frame, run or step; all lines after the output changes
+
+		const LineMask &changedLines() const { return changed; }
+
+		//Input; a set bit is a pressed button (Emulator::Button)
+		//Applies right away, pressing a button of a selected row requests the joypad interrupt
+
+		void setButtons(u8 pressed);
+
+		//Save states
+		//Only the registers, events and writable memory are stored; the page table and code caches are rebuilt
+		//Neither allocates, so a state can be taken (or restored) every frame
+
+		usz stateSize();
+		bool saveState(u8 *state, usz size);
+		bool loadState(const u8 *state, usz size);
+
+		//Delta states; only the pages written since the last state was saved or loaded
+		//Loading one on top of that state is the same as loading a full state of the same moment
+
+		usz deltaStateSize();
+		usz saveDeltaState(u8 *state, usz size);		//Returns the size used, 0 if the buffer is too small
+		bool loadDeltaState(const u8 *state, usz size);
+
 		//"Hardware" constants
 		//
 
@@ -65,8 +276,24 @@ namespace gb {
 			MBC_RAM				= (MemoryMapper::mmuStart | 0)  << 8,			//Memory bank controller memory offset
 			MBC_ROM				= (MemoryMapper::mmuStart | 8)  << 8,			//Memory bank controller memory offset
 
-			ROM_BANK			= (MemoryMapper::mmuStart | 16)  << 8,			//Memory bank controller memory offset
-			RAM_BANK			= (MemoryMapper::mmuStart | 17)  << 8,			//Memory bank controller memory offset
+			ROM_BANK			= (MemoryMapper::mmuStart | 16)  << 8,			//ROM bank register (u16 for MBC5)
+			RAM_BANK			= (MemoryMapper::mmuStart | 20)  << 8,			//RAM bank register (or RTC register select for MBC3)
+			RAM_BANKS			= (MemoryMapper::mmuStart | 21)  << 8,			//Number of RAM banks in the cartridge
+			ROM_BANKS			= (MemoryMapper::mmuStart | 22)  << 8,			//Number of ROM banks in the cartridge (u16)
+
+			MBC_ROM0			= (MemoryMapper::mmuStart | 24)  << 8,			//Memory bank controller memory offset of [0x0000, 0x4000>
+
+			RTC					= (MemoryMapper::mmuStart | 32)  << 8,			//MBC3 clock; seconds, minutes, hours, day low, day high
+			RTC_LATCHED			= (MemoryMapper::mmuStart | 37)  << 8,			//MBC3 clock as it was when it was latched
+			RTC_LATCH			= (MemoryMapper::mmuStart | 42)  << 8,			//Last write to the latch register (0 then 1 latches)
+
+			BUTTONS				= (MemoryMapper::mmuStart | 43)  << 8,			//Pressed buttons (Emulator::Button); read through the joypad register
+			WINDOW_LINE			= (MemoryMapper::mmuStart | 44)  << 8,			//Line of the window to draw next; only advances on lines that show it
+			PPU_STAT			= (MemoryMapper::mmuStart | 45)  << 8,			//STAT bits of the PPU (mode, LY=LYC) and the STAT interrupt line (bit 7)
+
+			MBC_WRITE			= (MemoryMapper::controllerStart | 0)  << 8,	//MemoryMapper::ControllerWrite of the cartridge
+			MBC_READ			= (MemoryMapper::controllerStart | 8)  << 8,	//MemoryMapper::ControllerRead of the cartridge
+			MBC_MAP				= (MemoryMapper::controllerStart | 16)  << 8,	//MemoryMapper::ControllerMap of the cartridge
 
 			FLAGS				= (MemoryMapper::mmuStart    | 18) << 8,		//For switches; like enable interrupts
 
@@ -74,6 +301,17 @@ namespace gb {
 			ENABLE_ERAM			= FLAGS | 0x02,									//Enable extenral RAM (reading from it when disabled causes a crash)
 			ROM_RAM_MODE_SELECT = FLAGS | 0x04,									//Selecting the upper half of ROM memory or any other RAM bank
 			IS_IN_BIOS			= FLAGS | 0x08,									//Whether or not the bios is currently running
+			IS_HALTED			= FLAGS | 0x10,									//HALT; waiting for an enabled interrupt to be requested
+			IS_STOPPED			= FLAGS | 0x20,									//STOP; waiting for a button press (IS_HALTED is set as well)
+
+			SCHEDULE			= (MemoryMapper::mmuStart | 19) << 8,			//Writes the scheduler has to handle before the cpu continues
+
+			CHECK_INTERRUPTS	= SCHEDULE | 0x01,								//IF, IE or IME changed
+			TIMER_CHANGED		= SCHEDULE | 0x02,								//DIV, TIMA, TMA or TAC written
+			DIV_RESET			= SCHEDULE | 0x04,								//DIV written (which resets it)
+			DMA_STARTED			= SCHEDULE | 0x08,								//DMA written
+			SERIAL_STARTED		= SCHEDULE | 0x10,								//Transfer control written with the start bit
+			IDLE_LOOP			= SCHEDULE | 0x20,								//Jumped back to a loop that only polls I/O
 
 		};
 
@@ -95,6 +333,9 @@ namespace gb {
 			MMM01_R,
 			MMM01_RB,
 
+			MBC3_TIMER_B = 0xF,
+			MBC3_TIMER_RB,
+
 			MBC3 = 0x11,
 			MBC3_R,
 			MBC3_RB,
@@ -117,11 +358,45 @@ namespace gb {
 
 		};
 
+		enum Button : u8 {
+
+			BUTTON_RIGHT		= 0x01,
+			BUTTON_LEFT			= 0x02,
+			BUTTON_UP			= 0x04,
+			BUTTON_DOWN			= 0x08,
+
+			BUTTON_A			= 0x10,
+			BUTTON_B			= 0x20,
+			BUTTON_SELECT		= 0x40,
+			BUTTON_START		= 0x80
+
+		};
+
+		enum CpuMode : u8 {
+			INTERPRETER,			//Fetch and dispatch every instruction (threaded with GB_THREADED_DISPATCH)
+			BLOCK_CACHE				//Run pre-decoded blocks of straight-line code
+		};
+
 		//Memory and output
 
 		Memory m;
 		oic::Grid2D<u32> output;
 
+		OutputFormat outputFormat = OUTPUT_RGBA;
+		u8 *shadeOutput{};
+
+		CpuMode cpuMode = INTERPRETER;
+
+		//Frame skipping; a frame that isn't rendered keeps the PPU timing, STAT/LY and interrupts exact,
+		//but skips all pixel work and leaves the output of the last rendered frame
+		//A frame is rendered if render is set and it's one of every renderEvery frames (0 renders none)
+		//This applies to run and step as well, they decide again at every vblank
+
+		bool render = true;
+		u32 renderEvery = 1;
+		BlockCache blockCache;
+		TileCache tileCache;
+
 		//CR mapping
 		//B,C, D,E, H,L, (HL),A
 		//(HL) should be handled by the instruction itself since it uses the memory model
@@ -130,6 +405,13 @@ namespace gb {
 		};
 
 		//Registers
+		//Anonymous structs are an extension MSVC, GCC and Clang all support
+
+		#ifdef __GNUC__
+			#pragma GCC diagnostic push
+			#pragma GCC diagnostic ignored "-Wpedantic"
+		#endif
+
 		union {
 
 			//8-bit registers
@@ -149,14 +431,37 @@ namespace gb {
 			u16 lregs[6]{};
 		};
 
+		#ifdef __GNUC__
+			#pragma GCC diagnostic pop
+		#endif
+
 		ns lastTime = 0;
-		usz ppuCycle = 0;
+
+		u64 frames = 0;			//Frames finished (vblanks), by any of frame, frameNoSync, run or step
+
+		u64 cycle = 0;			//Machine cycles since power on
+		u64 divBase = 0;		//Cycle DIV was last reset at; the timers tick relative to it
+
+		Scheduler scheduler;
 
 	private:
 
+		explicit Emulator(const Emulator *parent);
+
 		template<bool doSync>
 		void internalFrame(const oic::Grid2D<u32> &buffer);
 
+		FrameRing frameRing;
+
+		u8 *target{};				//Buffer of the lines being drawn, nullptr if they aren't
+		LineMask drawnLines;		//Lines drawn since the frame started (LY wrapped to 0)
+
+		//Hash of every line of the last frame drawn, to find the ones that changed since
+
+		u64 lineHashes[specs::height]{};
+		LineMask changed;
+		bool allLinesChanged = true;		//Hashes don't match the output (first frame or the output changed)
+
 		//Debug
 
 		template<bool isCb = false, typename ...args>
@@ -208,6 +513,17 @@ namespace gb {
 
 		_inline_ usz cbInstruction();
 
+		//Block cache
+
+		template<u8 c> static usz decodedOp(Emulator &e);
+		template<u8 c> static usz decodedCb(Emulator &e);
+
+		_inline_ u32 blockKey();
+		_inline_ Block *decodeBlock(Block &block, u32 key);
+		_inline_ Block *findBlock();
+		_inline_ usz runBlock(const Block &block, usz budget);
+		_inline_ usz blockStep(usz budget);
+
 		template<u8 c> _inline_ bool cond();
 
 		//Switch cases
@@ -218,15 +534,44 @@ namespace gb {
 		//Steps
 
 		_inline_ usz cpuStep();
+		_inline_ usz threadedStep(usz budget);
+		_inline_ usz cpuRun(usz budget);
 		_inline_ usz interruptHandler();
-		_inline_ void ppuStep(bool &pushScreen, u32 *ppu);
+
+		//Idle loops
+
+		_inline_ void detectIdleLoop();
+		_inline_ usz skipIdleLoop(usz budget);
+
+		//Events
+
+		_inline_ void requestInterrupt(u8 mask);
+		_inline_ void runEvents(bool &pushScreen);
+		_inline_ void handleWrites();
+		_inline_ void scheduleTimer();
+
+		_inline_ void ppuEvent(u64 at, bool &pushScreen);
+		_inline_ void timerEvent(u64 at);
+		_inline_ void dmaEvent();
+		_inline_ void serialEvent();
 
 		//PPU helpers
 
-		template<bool on>
-		_inline_ void pushBlank(u32 *ppu, u32 *ppuEnd);
+		u8 *outputTarget();
+
+		bool rendersFrame() const { return render && renderEvery && frames % renderEvery == 0; }
+
+		_inline_ void markLine(u8 ly, u64 hash);
+		_inline_ void blankLine(u8 ly);
+		_inline_ void finishTarget();
+
+		_inline_ void pushLine();
+		_inline_ void writeLine(u8 ly, const u8 *shades);
+		_inline_ void updateTiles();
 
-		_inline_ void pushLine(u32 *ppu);
+		_inline_ void drawTiles(u8 *line, u16 map, u8 firstTile, u8 y, bool signedTiles);
+		_inline_ usz scanOam(u8 ly, u8 height, u8 *visible);
+		_inline_ bool drawSprites(u8 ly, u8 *indices, u8 *attributes);
 
 
 	};
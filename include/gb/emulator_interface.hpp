@@ -30,6 +30,8 @@ namespace gb {
 
 		Emulator em;
 
+		u8 buttons{};								//Emulator::Button bits of the keys that are held
+
 	public:
 
 		EmulatorInterface(Graphics &g, const Buffer&, const Buffer &bios);
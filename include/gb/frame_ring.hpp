@@ -0,0 +1,149 @@
+#pragma once
+#include "types/types.hpp"
+#include <mutex>
+
+namespace gb {
+
+	//A bit per line of the screen; line y is bit y % 64 of word y / 64
+
+	struct LineMask {
+
+		u64 bits[3]{};
+
+		_inline_ void set(usz y) { bits[y >> 6] |= u64(1) << (y & 63); }
+		_inline_ bool test(usz y) const { return bits[y >> 6] & (u64(1) << (y & 63)); }
+		_inline_ bool any() const { return bits[0] | bits[1] | bits[2]; }
+
+		_inline_ LineMask &operator|=(const LineMask &other) {
+
+			for (usz i = 0; i < 3; ++i)
+				bits[i] |= other.bits[i];
+
+			return *this;
+		}
+	};
+
+	//Buffers owned by the caller that frames are drawn into, handed over without copying or clearing
+	//A buffer is free, being drawn, done (waiting to be acquired) or acquired by the consumer
+	//Done frames are acquired in the order they were drawn; the consumer can be another thread
+
+	struct FrameRing {
+
+		enum State : u8 {
+			FREE,
+			DRAWING,
+			DONE,
+			ACQUIRED
+		};
+
+		struct Frame {
+			void *buffer;
+			State state;
+			u64 id;								//Order they were finished in
+			LineMask changed;					//Lines that differ from the frame before it
+		};
+
+		void set(void *const *buffers, usz count) {
+
+			std::lock_guard<std::mutex> guard(lock);
+
+			frames.clear();
+
+			for (usz i = 0; i < count; ++i)
+				frames.push_back({ buffers[i], FREE, 0, {} });
+
+			dropped = {};
+		}
+
+		bool empty() const { return frames.empty(); }
+
+		//A free buffer, otherwise the oldest frame nobody acquired yet; nullptr if the consumer holds all of them
+		//A frame that's drawn over never reaches the consumer, so the lines it changed move on to the one after it
+
+		void *begin() {
+
+			std::lock_guard<std::mutex> guard(lock);
+
+			Frame *frame = find(FREE);
+
+			if (!frame) {
+
+				if (!(frame = find(DONE)))
+					return nullptr;
+
+				frame->state = DRAWING;
+
+				if (Frame *next = find(DONE))
+					next->changed |= frame->changed;
+
+				else dropped |= frame->changed;
+			}
+
+			frame->state = DRAWING;
+			return frame->buffer;
+		}
+
+		void finish(void *buffer, const LineMask &changed) {
+
+			std::lock_guard<std::mutex> guard(lock);
+
+			for (Frame &frame : frames)
+				if (frame.buffer == buffer && frame.state == DRAWING) {
+					frame.state = DONE;
+					frame.id = ++finished;
+					frame.changed = changed;
+					frame.changed |= dropped;
+					dropped = {};
+				}
+		}
+
+		//Oldest done frame and the lines that changed since the frame acquired before it, nullptr if there's none
+
+		void *acquire(LineMask *changed = nullptr) {
+
+			std::lock_guard<std::mutex> guard(lock);
+
+			Frame *frame = find(DONE);
+
+			if (!frame)
+				return nullptr;
+
+			if (changed)
+				*changed = frame->changed;
+
+			frame->state = ACQUIRED;
+			return frame->buffer;
+		}
+
+		void release(void *buffer) {
+
+			std::lock_guard<std::mutex> guard(lock);
+
+			for (Frame &frame : frames)
+				if (frame.buffer == buffer && frame.state == ACQUIRED)
+					frame.state = FREE;
+		}
+
+	private:
+
+		//Must be called with the lock held; the oldest if there's more than one
+
+		Frame *find(State state) {
+
+			Frame *result{};
+
+			for (Frame &frame : frames)
+				if (frame.state == state && (!result || frame.id < result->id))
+					result = &frame;
+
+			return result;
+		}
+
+		std::mutex lock;
+		List<Frame> frames;
+		u64 finished{};
+
+		LineMask dropped;						//Changes of frames drawn over, for the next one that's finished
+	};
+
+}
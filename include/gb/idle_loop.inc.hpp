@@ -0,0 +1,69 @@
+
+namespace gb {
+
+	//Games wait for LY, STAT or an interrupt flag with loops like:
+	//	ldh a,(44)	/ ld a,(ff44)
+	//	cp 90		/ and x / bit n,a
+	//	jr nz,loop
+	//Nothing in there writes, so the value can only change once an event runs
+
+	_inline_ void Emulator::detectIdleLoop() {
+
+		u16 addr = pc;
+
+		//Load from I/O or HRAM into A
+
+		const u8 load = m[addr];
+
+		if (load == 0xF0)
+			addr += 2;
+
+		else if (load == 0xFA && m[u16(addr + 2)] == 0xFF)
+			addr += 3;
+
+		else return;
+
+		//Compare or test A
+
+		const u8 test = m[addr];
+
+		if (test == 0xFE || test == 0xE6 || (test == 0xCB && (m[u16(addr + 1)] & 0xC7) == 0x47))
+			addr += 2;
+
+		else return;
+
+		//Conditional JR back to the load
+
+		const u8 jr = m[addr];
+
+		if ((jr & 0xE7) != 0x20 || u16(addr + 2 + m.get<i8>(u16(addr + 1))) != pc)
+			return;
+
+		setFlag<true, Emulator::IDLE_LOOP>();
+	}
+
+	//Skip the iterations of an idle loop that finish before the budget is used up
+	//One iteration is run to find out what it costs; every one after that is exactly the same
+
+	_inline_ usz Emulator::skipIdleLoop(usz budget) {
+
+		u8 &pending = m.getMemory<u8>(Emulator::SCHEDULE >> 8);
+		constexpr u8 idleLoop = Emulator::IDLE_LOOP & 0xFF;
+
+		const u16 start = pc;
+		usz cycles{};
+
+		do cycles += cpuStep();
+		while (pc != start && cycles < budget && !(pending & ~idleLoop));
+
+		pending &= ~idleLoop;
+
+		if (pc != start || cycles >= budget || pending)
+			return cycles;
+
+		//The cpu would've kept looping until the budget was used up
+
+		return cycles + (budget - cycles - 1) / cycles * cycles;
+	}
+
+}
@@ -0,0 +1,442 @@
+
+namespace gb {
+
+	//Cartridge header
+
+	_inline_ usz MemoryMapper::romBanks(const u8 *rom) {
+
+		const u8 banks = rom[0x148];
+
+		switch (banks) {
+			case 52: return 72;
+			case 53: return 80;
+			case 54: return 96;
+		}
+
+		if (banks > 8)
+			oic::System::log()->fatal("ROM banks are invalid");
+
+		return usz(2 << banks);
+	}
+
+	//Banks are 8 KiB; the 2 KiB cartridges and the 512 nibbles of MBC2 get a full bank
+
+	_inline_ usz MemoryMapper::ramBanks(const u8 *rom) {
+
+		const u8 type = rom[0x147];
+
+		if (type == Emulator::MBC2 || type == Emulator::MBC2_B)
+			return 1;
+
+		switch (rom[0x149]) {
+			case 0: return 0;
+			case 1: return 1;
+			case 2: return 1;
+			case 3: return 4;
+			case 4: return 16;
+			case 5: return 8;
+			default:
+				oic::System::log()->fatal("RAM banks are invalid");
+				return 0;
+		}
+	}
+
+	//Helpers shared by the controllers
+
+	namespace mbc {
+
+		_inline_ bool ramEnabled(Memory *m) {
+			return m->getMemory<u8>(Emulator::ENABLE_ERAM >> 8) & (Emulator::ENABLE_ERAM & 0xFF);
+		}
+
+		_inline_ void enableRam(Memory *m, u8 v) {
+
+			u8 &mem = m->getMemory<u8>(Emulator::ENABLE_ERAM >> 8);
+			constexpr u8 bit = Emulator::ENABLE_ERAM & 0xFF;
+
+			if ((v & 0xF) == 0xA) mem |= bit;
+			else mem &= ~bit;
+		}
+
+		_inline_ u8 disabledRead(Memory*, u16) {
+			oic::System::log()->fatal("Emulator tried to access external memory, while this was not enabled");
+			return 0xFF;
+		}
+
+		_inline_ void disabledWrite(Memory*, u16) {
+			oic::System::log()->fatal("Emulator tried to access external memory, while this was not enabled");
+		}
+	}
+
+	//ROM only; RAM (if any) is always enabled
+
+	struct NoMbc {
+
+		static void map(Memory *m) {
+			MemoryMapper::setRomBank(m, 1);
+			MemoryMapper::setRamBank(m, 0, true);
+		}
+
+		static void init(Memory *m) {
+			mbc::enableRam(m, 0xA);
+			map(m);
+		}
+
+		static void write(Memory *m, u16 a, u8) {
+			if (a >= 0xA000)
+				mbc::disabledWrite(m, a);
+		}
+
+		static u8 read(Memory *m, u16 a) {
+			return mbc::disabledRead(m, a);
+		}
+	};
+
+	//MBC1; up to 2 MiB ROM and 32 KiB RAM
+	//ROM_BANK holds the lower 5 bits of the ROM bank, RAM_BANK the 2 bit register above it
+	//The 2 bit register selects the RAM bank and ROM bank 0 too in mode 1
+
+	struct Mbc1 {
+
+		static void map(Memory *m) {
+
+			const usz lower = m->getMemory<u8>(Emulator::ROM_BANK >> 8);
+			const usz upper = m->getMemory<u8>(Emulator::RAM_BANK >> 8);
+			const bool mode = m->getMemory<u8>(Emulator::ROM_RAM_MODE_SELECT >> 8) & (Emulator::ROM_RAM_MODE_SELECT & 0xFF);
+
+			MemoryMapper::setRomBank(m, upper << 5 | lower, mode ? upper << 5 : 0);
+			MemoryMapper::setRamBank(m, mode ? upper : 0, mbc::ramEnabled(m));
+		}
+
+		static void init(Memory *m) {
+			m->getMemory<u8>(Emulator::ROM_BANK >> 8) = 1;
+			map(m);
+		}
+
+		static void write(Memory *m, u16 a, u8 v) {
+
+			switch (a >> 13) {
+
+				case 0:
+					mbc::enableRam(m, v);
+					break;
+
+				//Bank 0 can't be selected, so 0x20, 0x40 and 0x60 map to the bank after it
+
+				case 1:
+					m->getMemory<u8>(Emulator::ROM_BANK >> 8) = v & 0x1F ? v & 0x1F : 1;
+					break;
+
+				case 2:
+					m->getMemory<u8>(Emulator::RAM_BANK >> 8) = v & 3;
+					break;
+
+				case 3: {
+
+					u8 &mem = m->getMemory<u8>(Emulator::ROM_RAM_MODE_SELECT >> 8);
+					constexpr u8 bit = Emulator::ROM_RAM_MODE_SELECT & 0xFF;
+
+					if (v & 1) mem |= bit;
+					else mem &= ~bit;
+
+					break;
+				}
+
+				default:
+					mbc::disabledWrite(m, a);
+					return;
+			}
+
+			map(m);
+		}
+
+		static u8 read(Memory *m, u16 a) {
+			return mbc::disabledRead(m, a);
+		}
+	};
+
+	//MBC2; up to 256 KiB ROM and 512 nibbles of RAM, repeated over [0xA000, 0xC000>
+	//Bit 8 of the address selects between the RAM enable and ROM bank register
+	//Writes go through the controller, so the upper nibble always reads as 1s
+
+	struct Mbc2 {
+
+		static void map(Memory *m) {
+
+			MemoryMapper::setRomBank(m, m->getMemory<u8>(Emulator::ROM_BANK >> 8));
+
+			const bool enabled = mbc::ramEnabled(m);
+
+			for (u8 i = 0xA0; i < 0xC0; ++i)
+				MemoryMapper::mapPages(
+					m, MemoryMapper::readPages, i, i,
+					enabled ? MemoryMapper::ramStart - (usz(i) << 8 & 0xFE00) : 0
+				);
+		}
+
+		static void init(Memory *m) {
+			m->getMemory<u8>(Emulator::ROM_BANK >> 8) = 1;
+			map(m);
+		}
+
+		static void write(Memory *m, u16 a, u8 v) {
+
+			if (a >= 0xA000) {
+
+				if (!mbc::ramEnabled(m))
+					mbc::disabledWrite(m, a);
+
+				else {
+					m->getMemory<u8>(MemoryMapper::ramStart + (a & 0x1FF)) = v | 0xF0;
+					MemoryMapper::invalidateCode<u8>(m, a);
+					MemoryMapper::markDirty(m, m->host(MemoryMapper::ramStart + (a & 0x1FF)));
+				}
+
+				return;
+			}
+
+			if (a >= 0x4000)
+				return;
+
+			if (a & 0x100)
+				m->getMemory<u8>(Emulator::ROM_BANK >> 8) = v & 0xF ? v & 0xF : 1;
+
+			else mbc::enableRam(m, v);
+
+			map(m);
+		}
+
+		static u8 read(Memory *m, u16 a) {
+			return mbc::disabledRead(m, a);
+		}
+	};
+
+	//MBC3; up to 2 MiB ROM, 32 KiB RAM and a real time clock
+	//RAM bank 8-C selects a clock register instead, which goes through the controller
+
+	struct Mbc3 {
+
+		static constexpr u8 rtcMask[] = { 0x3F, 0x3F, 0x1F, 0xFF, 0xC1 };
+
+		static void map(Memory *m) {
+
+			const u8 select = m->getMemory<u8>(Emulator::RAM_BANK >> 8);
+
+			MemoryMapper::setRomBank(m, m->getMemory<u8>(Emulator::ROM_BANK >> 8));
+			MemoryMapper::setRamBank(m, select & 3, select < 8 && mbc::ramEnabled(m));
+		}
+
+		static void init(Memory *m) {
+			m->getMemory<u8>(Emulator::ROM_BANK >> 8) = 1;
+			map(m);
+		}
+
+		static void write(Memory *m, u16 a, u8 v) {
+
+			switch (a >> 13) {
+
+				case 0:
+					mbc::enableRam(m, v);
+					break;
+
+				case 1:
+					m->getMemory<u8>(Emulator::ROM_BANK >> 8) = v & 0x7F ? v & 0x7F : 1;
+					break;
+
+				case 2:
+					m->getMemory<u8>(Emulator::RAM_BANK >> 8) = v;
+					break;
+
+				//Writing 0 and then 1 copies the clock into the registers that can be read
+
+				case 3: {
+
+					u8 &latch = m->getMemory<u8>(Emulator::RTC_LATCH >> 8);
+
+					if (latch == 0 && v == 1)
+						for (usz i = 0; i < 5; ++i)
+							m->getMemory<u8>((Emulator::RTC_LATCHED >> 8) + i) = m->getMemory<u8>((Emulator::RTC >> 8) + i);
+
+					latch = v;
+					return;
+				}
+
+				//Clock register
+
+				default: {
+
+					const u8 select = m->getMemory<u8>(Emulator::RAM_BANK >> 8);
+
+					if (!mbc::ramEnabled(m) || select < 8 || select > 0xC)
+						mbc::disabledWrite(m, a);
+
+					else m->getMemory<u8>((Emulator::RTC >> 8) + select - 8) = v & rtcMask[select - 8];
+
+					return;
+				}
+			}
+
+			map(m);
+		}
+
+		static u8 read(Memory *m, u16 a) {
+
+			const u8 select = m->getMemory<u8>(Emulator::RAM_BANK >> 8);
+
+			if (!mbc::ramEnabled(m) || select < 8 || select > 0xC)
+				return mbc::disabledRead(m, a);
+
+			return m->getMemory<u8>((Emulator::RTC_LATCHED >> 8) + select - 8);
+		}
+	};
+
+	//MBC5; up to 8 MiB ROM and 128 KiB RAM
+	//The ROM bank is 9 bits and bank 0 can be selected as well
+
+	struct Mbc5 {
+
+		static void map(Memory *m) {
+			MemoryMapper::setRomBank(m, m->getMemory<u16>(Emulator::ROM_BANK >> 8));
+			MemoryMapper::setRamBank(m, m->getMemory<u8>(Emulator::RAM_BANK >> 8), mbc::ramEnabled(m));
+		}
+
+		static void init(Memory *m) {
+			m->getMemory<u16>(Emulator::ROM_BANK >> 8) = 1;
+			map(m);
+		}
+
+		static void write(Memory *m, u16 a, u8 v) {
+
+			u16 &romBank = m->getMemory<u16>(Emulator::ROM_BANK >> 8);
+
+			switch (a >> 12) {
+
+				case 0x0: case 0x1:
+					mbc::enableRam(m, v);
+					break;
+
+				case 0x2:
+					romBank = u16((romBank & 0x100) | v);
+					break;
+
+				case 0x3:
+					romBank = u16((romBank & 0xFF) | (v & 1) << 8);
+					break;
+
+				//Bit 3 drives the rumble motor on rumble cartridges
+
+				case 0x4: case 0x5:
+					m->getMemory<u8>(Emulator::RAM_BANK >> 8) = v & 0xF;
+					break;
+
+				case 0x6: case 0x7:
+					return;
+
+				default:
+					mbc::disabledWrite(m, a);
+					return;
+			}
+
+			map(m);
+		}
+
+		static u8 read(Memory *m, u16 a) {
+			return mbc::disabledRead(m, a);
+		}
+	};
+
+	//Picked once when the ROM is loaded; the bank switches are instantiated per controller
+
+	template<typename Mbc>
+	_inline_ void MemoryMapper::useController(Memory *m) {
+		m->getMemory<u64>(Emulator::MBC_WRITE >> 8) = u64(ControllerWrite(&Mbc::write));
+		m->getMemory<u64>(Emulator::MBC_READ >> 8) = u64(ControllerRead(&Mbc::read));
+		m->getMemory<u64>(Emulator::MBC_MAP >> 8) = u64(ControllerMap(&Mbc::map));
+		Mbc::init(m);
+	}
+
+	_inline_ void MemoryMapper::remap(Memory *m) {
+		initPages(m);
+		ControllerMap(m->getMemory<u64>(Emulator::MBC_MAP >> 8))(m);
+	}
+
+	//Returns whether or not the cartridge has a clock
+
+	_inline_ bool MemoryMapper::initController(Memory *m, const u8 *rom) {
+
+		m->getMemory<u16>(Emulator::ROM_BANKS >> 8) = u16(romBanks(rom));
+		m->getMemory<u8>(Emulator::RAM_BANKS >> 8) = u8(ramBanks(rom));
+
+		switch (rom[0x147]) {
+
+			case Emulator::ROM:
+			case Emulator::ROM_R:
+			case Emulator::ROM_RB:
+				useController<NoMbc>(m);
+				return false;
+
+			case Emulator::MBC1:
+			case Emulator::MBC1_R:
+			case Emulator::MBC1_RB:
+				useController<Mbc1>(m);
+				return false;
+
+			case Emulator::MBC2:
+			case Emulator::MBC2_B:
+				useController<Mbc2>(m);
+				return false;
+
+			case Emulator::MBC3_TIMER_B:
+			case Emulator::MBC3_TIMER_RB:
+				useController<Mbc3>(m);
+				return true;
+
+			case Emulator::MBC3:
+			case Emulator::MBC3_R:
+			case Emulator::MBC3_RB:
+				useController<Mbc3>(m);
+				return false;
+
+			case Emulator::MBC5:
+			case Emulator::MBC5_R:
+			case Emulator::MBC5_RB:
+			case Emulator::MBC5_RUMBLE:
+			case Emulator::MBC5_R_RUMBLE:
+			case Emulator::MBC5_RB_RUMBLE:
+				useController<Mbc5>(m);
+				return false;
+
+			default:
+				oic::System::log()->fatal("Memory bank controller isn't supported");
+				return false;
+		}
+	}
+
+	//Advance the MBC3 clock by a second, unless it's halted (bit 6 of the day high register)
+	//The day counter is 9 bits and sets the carry bit (bit 7) once it overflows
+
+	_inline_ void MemoryMapper::tickRtc(Memory *m) {
+
+		u8 *rtc = &m->getMemory<u8>(Emulator::RTC >> 8);
+
+		if (rtc[4] & 0x40)
+			return;
+
+		if (++rtc[0] < 60) return;
+		rtc[0] = 0;
+
+		if (++rtc[1] < 60) return;
+		rtc[1] = 0;
+
+		if (++rtc[2] < 24) return;
+		rtc[2] = 0;
+
+		if (++rtc[3]) return;
+
+		if (rtc[4] & 1)
+			rtc[4] = (rtc[4] & ~1) | 0x80;
+
+		else rtc[4] |= 1;
+	}
+
+}
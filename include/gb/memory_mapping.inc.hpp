@@ -3,174 +3,253 @@ namespace gb {
 
 	//Memory emulation
 
-	_inline_ void MemoryMapper::calculateRomOffset(Memory *m) {
+	//Page table
 
-		u8 bank = m->getMemory<u8>(Emulator::ROM_BANK >> 8);
+	//Offsets are in the layout and stored as host offsets; 0 stays unmapped
+	//They're relative to the address, so the range is found through the first mapped address
 
-		u8 mem = m->getMemory<u8>(Emulator::ROM_RAM_MODE_SELECT >> 8);
-		constexpr u8 bit = Emulator::ROM_RAM_MODE_SELECT & 0xFF;
+	_inline_ void MemoryMapper::mapPages(Memory *m, usz table, u8 first, u8 last, u64 offset) {
 
-		if (mem & bit)
-			bank &= 0x1F;
+		if (offset)
+			offset = m->host(offset + (usz(first) << 8)) - (usz(first) << 8);
 
-		m->getMemory<u64>(Emulator::MBC_ROM >> 8) = romStart | ((bank - 1) << 14);
+		for (usz i = first; i <= last; ++i)
+			m->getMemory<u64>(table + i * sizeof(u64)) = offset;
 	}
 
-	template<typename T>
-	_inline_ T MemoryMapper::read(Memory *m, u16 a) {
+	//The BIOS covers the first page until it's unmapped
 
-		u8 &mem = m->getMemory<u8>(Emulator::IS_IN_BIOS >> 8);
-		constexpr u8 bit = Emulator::IS_IN_BIOS & 0xFF;
+	_inline_ void MemoryMapper::mapRom(Memory *m) {
 
-		if (mem & bit && a < MemoryMapper::biosLength)
-			return *(T*)(biosStart | a);
+		const bool inBios = m->getMemory<u8>(Emulator::IS_IN_BIOS >> 8) & (Emulator::IS_IN_BIOS & 0xFF);
+		const u64 rom0 = m->getMemory<u64>(Emulator::MBC_ROM0 >> 8);
+
+		mapPages(m, readPages, 0x00, 0x00, inBios ? biosStart : rom0);
+		mapPages(m, readPages, 0x01, 0x3F, rom0);
+		mapPages(m, readPages, 0x40, 0x7F, m->getMemory<u64>(Emulator::MBC_ROM >> 8));
+	}
 
-		switch (a >> 12) {
+	//External RAM goes through the controller while it's disabled (or mapped to something else)
 
-			case 0x0: case 0x1:
-			case 0x2: case 0x3:
-				return *(T*)(romStart | a);
+	_inline_ void MemoryMapper::mapRam(Memory *m, bool mapped) {
 
-			case 0x4: case 0x5:
-			case 0x6: case 0x7:
-				return *(T*)(m->getMemory<u64>(Emulator::MBC_ROM >> 8) | a);
+		const u64 offset = mapped ? m->getMemory<u64>(Emulator::MBC_RAM >> 8) : 0;
 
-			case 0xA: case 0xB:
+		mapPages(m, readPages, 0xA0, 0xBF, offset);
+		mapPages(m, writePages, 0xA0, 0xBF, offset);
+	}
 
-				if (!(m->getMemory<u8>(Emulator::ENABLE_ERAM >> 8) & (Emulator::ENABLE_ERAM & 0xFF)))
-					oic::System::log()->fatal("Emulator tried to access external memory, while this was not enabled");
+	//ROM and I/O writes always need a handler
+	//ROM and external RAM are mapped by the controller
 
-				return *(T*)(m->getMemory<u64>(Emulator::MBC_RAM >> 8) + a);
+	_inline_ void MemoryMapper::initPages(Memory *m) {
 
-			default:
-				return *(T*)(mapping | a);
-		}
+		mapPages(m, readPages, 0x80, 0x9F, mapping);
+		mapPages(m, readPages, 0xC0, 0xFF, mapping);
 
+		mapPages(m, writePages, 0x00, 0x7F, 0);
+		mapPages(m, writePages, 0x80, 0x9F, mapping);
+		mapPages(m, writePages, 0xC0, 0xFE, mapping);
+		mapPages(m, writePages, 0xFF, 0xFF, 0);
 	}
 
-	template<typename T>
-	_inline_ void MemoryMapper::write(Memory *m, u16 a, const T &t) {
+	_inline_ void MemoryMapper::unmapBios(Memory *m) {
+		m->getMemory<u8>(Emulator::IS_IN_BIOS >> 8) &= ~(Emulator::IS_IN_BIOS & 0xFF);
+		mapRom(m);
+	}
 
-		//TODO: Check 0x147 to see which MBC type we need (See Emulator::MemoryControllerType
+	//Banks wrap around the size of the cartridge
+	//The offsets are added to the address, so #n is relative to 0x4000 and RAM to 0xA000
 
-		//Mappings from write to read memory
+	_inline_ void MemoryMapper::setRomBank(Memory *m, usz bank, usz rom0Bank) {
 
-		switch (a >> 12) {
+		const usz banks = m->getMemory<u16>(Emulator::ROM_BANKS >> 8);
 
-			case 0x0: case 0x1: {
-			
-				bool enableRAM = ((u8)t & 0xF) == 0xA;
+		m->getMemory<u64>(Emulator::MBC_ROM0 >> 8) = romStart + ((rom0Bank % banks) << 14);
+		m->getMemory<u64>(Emulator::MBC_ROM >> 8) = romStart + ((bank % banks) << 14) - 0x4000;
+		mapRom(m);
+	}
 
-				u8 &mem = m->getMemory<u8>(Emulator::ENABLE_ERAM >> 8);
-				constexpr u8 bit = Emulator::ENABLE_ERAM & 0xFF;
+	_inline_ void MemoryMapper::setRamBank(Memory *m, usz bank, bool mapped) {
 
-				if(enableRAM) mem |= bit;
-				else mem &= ~bit;
+		const usz banks = m->getMemory<u8>(Emulator::RAM_BANKS >> 8);
 
-				break;
-			}
+		if (!banks)
+			mapped = false;
 
-			//Select lower 5 bit rom number
-			//Banks 0x20, 0x40 and 0x60 are unavailable, so 125 banks
+		else m->getMemory<u64>(Emulator::MBC_RAM >> 8) = ramStart + ((bank % banks) << 13) - 0xA000;
 
-			case 0x2: case 0x3: {
-					
-				//TODO: MBC2 can only set the lower 4 bits
+		mapRam(m, mapped);
+	}
 
-				//Lower 5-bits need to be non-zero
+	//Bump the write generation of the written page(s), so decoded blocks in it are invalidated
 
-				u8 &romBank = m->getMemory<u8>(Emulator::ROM_BANK >> 8);
+	template<typename T>
+	_inline_ void MemoryMapper::invalidateCode(Memory *m, u16 a) {
 
-				u8 tu5 = (u8)t & 0x1F;
+		++m->getMemory<u32>(codeGenStart + usz((a >> 8) - 0x80) * sizeof(u32));
 
-				romBank &= ~0x1F;
-				romBank |= tu5 ? tu5 : 1;
+		if constexpr (sizeof(T) > 1)
+			if (u8(a + sizeof(T) - 1) < u8(a) && a < 0xFF00)
+				++m->getMemory<u32>(codeGenStart + usz((a >> 8) - 0x7F) * sizeof(u32));
+	}
 
-				calculateRomOffset(m);
+	//Flag the 256 byte page a host address in [cpuStart, ramStart + ramLength> belongs to
 
-				break;
-			}
+	_inline_ void MemoryMapper::markDirty(Memory *m, u64 host) {
+		m->getMemory<u8>(dirtyStart + usz((host - m->host(cpuStart)) >> 8)) = 1;
+	}
 
-			//Select upper 2-bit rom number or 2-bit ram number depending on the ROM_RAM_MODE_SELECT
+	//The lower nibble of the joypad register is low for the pressed buttons of the selected rows
+	//Bit 4 low selects the directions, bit 5 low the other buttons
 
-			case 0x4: case 0x5: {
+	_inline_ void MemoryMapper::updateJoypad(Memory *m) {
 
-				//TODO: MBC2 doesn't support this
+		u8 &joypad = m->getRef<u8>(io::joypad);
+		const u8 buttons = m->getMemory<u8>(Emulator::BUTTONS >> 8);
 
-				u8 mem = m->getMemory<u8>(Emulator::ROM_RAM_MODE_SELECT >> 8);
-				constexpr u8 bit = Emulator::ROM_RAM_MODE_SELECT & 0xFF;
+		u8 pressed{};
 
-				if (mem & bit) {
+		if (!(joypad & 0x10)) pressed |= buttons & 0xF;
+		if (!(joypad & 0x20)) pressed |= buttons >> 4;
 
-					u8 &romBank = m->getMemory<u8>(Emulator::ROM_BANK >> 8);
+		joypad = u8(0xC0 | (joypad & 0x30) | (~pressed & 0xF));
+	}
 
-					romBank &= ~0x60;
-					romBank |= (t & 3) << 5;
+	//Let the scheduler know about I/O writes that have side effects
 
-					calculateRomOffset(m);
-				}
+	_inline_ void MemoryMapper::ioWrite(Memory *m, u16 a) {
 
-				else {
+		u8 &pending = m->getMemory<u8>(Emulator::SCHEDULE >> 8);
 
-					u8 &ramBank = m->getMemory<u8>(Emulator::RAM_BANK >> 8);
+		switch (a) {
 
-					ramBank &= ~3;
-					ramBank |= t & 3;
+			case io::joypad:
+				updateJoypad(m);
+				break;
 
-					m->getMemory<u64>(Emulator::MBC_RAM >> 8) = (ramStart - 0xA000) + ((t & 3) << 13);
-				}
-			}
+			//Only the interrupt enables (bits 3-6) are written, the mode and LY=LYC belong to the PPU
 
-			//Selecting ROM/RAM mode
-			//If ROM banking mode is selected, only RAM bank 0 can be used
-			//If RAM banking mode is selected, only ROM bank 0-0x1F can be used
+			case io::stat:
+				m->getRef<u8>(io::stat) = u8((m->getRef<u8>(io::stat) & 0x78) | (m->getMemory<u8>(Emulator::PPU_STAT >> 8) & 7));
+				break;
 
-			case 0x6: case 0x7: {
+			case io::IF: case io::IE:
+				pending |= Emulator::CHECK_INTERRUPTS & 0xFF;
+				break;
 
-				//TODO: MBC2 doesn't support this
-					
-				bool useRamBankingMode = (u8)t == 0x1;
+			case io::div:
+				m->getRef<u8>(io::div) = 0;
+				pending |= (Emulator::DIV_RESET | Emulator::TIMER_CHANGED) & 0xFF;
+				break;
 
-				u8 &mem = m->getMemory<u8>(Emulator::ROM_RAM_MODE_SELECT >> 8);
-				constexpr u8 bit = Emulator::ROM_RAM_MODE_SELECT &0xFF;
+			case io::tima: case io::tma: case io::tac:
+				pending |= Emulator::TIMER_CHANGED & 0xFF;
+				break;
 
-				if (useRamBankingMode) {
+			case io::dma:
+				pending |= Emulator::DMA_STARTED & 0xFF;
+				break;
 
-					//Can use full range of ROM, but only the start of RAM
+			case io::transferControl:
 
-					mem |= bit;
-					m->getMemory<u64>(Emulator::MBC_RAM >> 8) = ramStart - 0xA000;
-					calculateRomOffset(m);
-				}
+				if (m->getRef<u8>(io::transferControl) & 0x80)
+					pending |= Emulator::SERIAL_STARTED & 0xFF;
 
-				else {
+				break;
+		}
+	}
 
-					//Can only use 0-0x1F from ROM during this mode, so set that and reset our ram address
+	template<typename T>
+	_inline_ T MemoryMapper::read(Memory *m, u16 a) {
 
-					mem &= ~bit;
-					calculateRomOffset(m);
+		//Pages don't have to be adjacent in memory
 
-					m->getMemory<u64>(Emulator::MBC_RAM >> 8) = (ramStart - 0xA000) + (m->getMemory<u8>(Emulator::RAM_BANK >> 8) << 13);
-				}
+		if constexpr (sizeof(T) > 1)
+			if (u8(a) == 0xFF)
+				return T(read<u8>(m, a) | read<u8>(m, u16(a + 1)) << 8);
 
-				break;
+		if (const u64 offset = m->getMemory<u64>(readPages + usz(a >> 8) * sizeof(u64)))
+			return *(T*)(offset + a);
+
+		//Only external RAM can be unmapped
+
+		const ControllerRead controller = (ControllerRead) m->getMemory<u64>(Emulator::MBC_READ >> 8);
+
+		if constexpr (sizeof(T) > 1)
+			return T(controller(m, a) | controller(m, u16(a + 1)) << 8);
+
+		else return T(controller(m, a));
+	}
+
+	template<typename T>
+	_inline_ void MemoryMapper::write(Memory *m, u16 a, const T &t) {
+
+		if constexpr (sizeof(T) > 1)
+			if (u8(a) == 0xFF) {
+				write<u8>(m, a, u8(t));
+				write<u8>(m, u16(a + 1), u8(t >> 8));
+				return;
 			}
 
-			//Write to external memory 
+		if (const u64 offset = m->getMemory<u64>(writePages + usz(a >> 8) * sizeof(u64))) {
+			*(T*)(offset + a) = t;
+			invalidateCode<T>(m, a);
+			markDirty(m, offset + a);
+			return;
+		}
 
-			case 0xA: case 0xB:
+		//Memory bank controller; ROM and unmapped external RAM
 
-				if (!(m->getMemory<u8>(Emulator::ENABLE_ERAM >> 8) & (Emulator::ENABLE_ERAM & 0xFF)))
-					oic::System::log()->fatal("Emulator tried to access external memory, while this was not enabled");
+		if (a < 0xC000) {
 
-				*(T*)(m->getMemory<u64>(Emulator::MBC_RAM >> 8) + a) = t;
-				break;
+			const ControllerWrite controller = (ControllerWrite) m->getMemory<u64>(Emulator::MBC_WRITE >> 8);
+
+			controller(m, a, u8(t));
 
-			//Writing to internal memory
+			if constexpr (sizeof(T) > 1)
+				controller(m, u16(a + 1), u8(t >> 8));
 
-			default:
-				*(T*)(mapping | a) = t;
+			return;
 		}
+
+		//I/O registers
+
+		m->getRef<T>(a) = t;
+		invalidateCode<T>(m, a);
+		ioWrite(m, a);
+
+		if constexpr (sizeof(T) > 1)
+			ioWrite(m, u16(a + 1));
+	}
+
+	//Proxy for m[a]
+
+	_inline_ Memory::Proxy::operator u8() const {
+		return m->get<u8>(a);
+	}
+
+	_inline_ Memory::Proxy &Memory::Proxy::operator=(u8 v) {
+		m->set(a, v);
+		return *this;
+	}
+
+	_inline_ u8 Memory::Proxy::operator+=(u8 v) {
+		const u8 r = u8(m->get<u8>(a) + v);
+		m->set(a, r);
+		return r;
+	}
+
+	//Stack
+
+	_inline_ void Stack::push(Memory &m, u16 &sp, u16 v) {
+		sp -= 2;
+		m.set(sp, v);
+	}
+
+	_inline_ void Stack::pop(Memory &m, u16 &sp, u16 &v) {
+		v = m.get<u16>(sp);
+		sp += 2;
 	}
 
 }
\ No newline at end of file
@@ -0,0 +1,71 @@
+#pragma once
+#include "gb/emulator.hpp"
+
+namespace gb {
+
+	//Joypad input per frame, with an embedded state every keyframeInterval frames
+	//The buttons only change between frames and frameNoSync doesn't depend on the time,
+	//so replaying the inputs from a keyframe gives the same frames as the recording
+
+	struct Movie {
+
+		static constexpr u32 magic = 0x564D4247;		//"GBMV"
+		static constexpr u16 version = 1;
+
+		Movie() = default;
+		explicit Movie(usz keyframeInterval);
+
+		//Recording; call before running every frame
+
+		void record(Emulator &e, u8 buttons);
+
+		//Restore the state from before a frame (0 - frames()); replays less than keyframeInterval frames without rendering them
+		//Returns false if the frame isn't in the movie or it was recorded on a different ROM
+
+		bool seek(Emulator &e, u64 frame);
+
+		//Seek and run frames (until the end of the movie) as fast as possible; returns the frames that ran
+
+		u64 play(Emulator &e, u64 from, u64 frames, const oic::Grid2D<u32> &buffer = {});
+
+		//Serialization
+		//Reading fails on damaged data or a movie with states of a different size than e's
+
+		void write(Buffer &out) const;
+		bool read(const Buffer &in, Emulator &e);
+
+		u64 frames() const { return inputs.size(); }
+		u8 input(u64 frame) const { return inputs[frame]; }
+
+		usz interval() const { return keyframeInterval; }
+
+	private:
+
+		struct Header {
+			u32 id;
+			u16 ver;
+			u16 romChecksum;							//Global checksum of the ROM (0x14E)
+			u8 headerChecksum;							//Header checksum of the ROM (0x14D)
+			u8 padding[3];
+			u32 keyframeInterval;
+			u64 frames, keyframes, stateSize;
+		};
+
+		struct Keyframe {
+			usz offset, size;							//Compressed state in states
+		};
+
+		bool matches(Emulator &e) const;
+
+		usz keyframeInterval = 600;					//10 seconds
+
+		u16 romChecksum{};
+		u8 headerChecksum{};
+		usz stateSize{};
+
+		List<u8> inputs;
+		List<Keyframe> keyframes;
+		Buffer states, state, scratch;
+	};
+
+}
@@ -0,0 +1,39 @@
+#pragma once
+#include "types/types.hpp"
+
+namespace gb::pixels {
+
+	//Pixel kernels of the PPU, in a scalar and vectorized variants
+	//The best one the CPU supports is picked once (CPUID); all of them give the same output
+
+	enum Isa : u8 {
+		SCALAR,
+		SSE2,
+		AVX2,
+		AVX512,				//AVX-512 F and BW
+		ISA_COUNT
+	};
+
+	//Bitplane rows (low byte, high byte) to a color index (0-3) per pixel; 2 bytes in and 8 out per row
+	//Rows is a multiple of 8
+
+	using DecodeRows = void (*)(const u8 *rows, usz count, u8 *out);
+
+	//Color indices to colors; count is a multiple of 16
+
+	using Colorize = void (*)(const u8 *indices, usz count, const u32 palette[4], u32 *out);
+
+	struct Kernels {
+		Isa isa;
+		const char *name;
+		DecodeRows decode;
+		Colorize colorize;
+	};
+
+	//nullptr if the CPU or compiler doesn't support it
+
+	const Kernels *get(Isa isa);
+
+	const Kernels &best();
+
+}
@@ -15,152 +15,454 @@ namespace gb {
 		rgb(66, 81, 3)		//OFF color
 	};
 
+	//Tile cache
+	//Decoding and coloring go through the kernels picked for the CPU (pixels::best)
+
+	_inline_ void Emulator::updateTiles() {
+
+		TileCache &cache = tileCache;
+		const u32 *gen = &m.getMemory<u32>(MemoryMapper::codeGenStart);		//Starts at page 0x80
+
+		const bool all = cache.pixels.empty();
+
+		if (all)
+			cache.pixels.resize(TileCache::tiles * TileCache::tileSize);
+
+		for (usz page = 0; page < TileCache::pages; ++page) {
+
+			if (!all && cache.gens[page] == gen[page])
+				continue;
+
+			cache.gens[page] = gen[page];
+
+			pixels::best().decode(
+				&m.getRef<u8>(u16(io::tileSet0 + (page << 8))), TileCache::tilesPerPage * 8,
+				cache.pixels.data() + page * TileCache::tilesPerPage * TileCache::tileSize
+			);
+		}
+	}
+
+	//Rows of the 21 tiles from a tile map row (as 8 pixels of color indices)
+	//Signed tiles are 0x8800 addressing, so 0x80-0xFF are tiles 128-255 and 0x00-0x7F are 256-383
+
+	_inline_ void Emulator::drawTiles(u8 *line, u16 map, u8 firstTile, u8 y, bool signedTiles) {
+
+		const u8 *tiles = &m.getRef<u8>(u16(map + ((y >> 3) << 5)));
+		const u8 flip = signedTiles ? 0x80 : 0;
+		const usz base = signedTiles ? 128 : 0;
+
+		for (usz t = 0; t < 21; ++t) {
+			const usz tile = (tiles[(firstTile + t) & 31] ^ flip) + base;
+			std::memcpy(line + t * 8, tileCache.row(tile, y & 7), 8);
+		}
+	}
+
+	//Up to 10 sprites that cover the line, in OAM order
+	//Which ones do is close to random, so it doesn't branch on it; visible has room for one more
+
+	static constexpr usz maxSpritesPerLine = 10;
+
+	_inline_ usz Emulator::scanOam(u8 ly, u8 height, u8 *visible) {
+
+		const u8 *oam = &m.getRef<u8>(0xFE00);
+		usz count{};
+
+		for (u8 i = 0; i < 40; ++i) {
+			visible[count] = i;
+			count += (u8(ly + 16 - oam[i * 4]) < height) & (count < maxSpritesPerLine);
+		}
+
+		return count;
+	}
+
+	//Sprite color indices (0 is transparent) and attributes per pixel, indexed by OAM x (screen x + 8)
+	//A lower x wins, then the earlier sprite; instead of sorting, every pixel keeps the x that drew it
+	//False if there are no sprites on the line
+
+	static constexpr usz spriteLineLength = 256 + 8;
+
+	_inline_ bool Emulator::drawSprites(u8 ly, u8 *indices, u8 *attributes) {
+
+		const u8 height = getFlagFromAddress<io::highSprites>() ? 16 : 8;
+
+		u8 visible[maxSpritesPerLine + 1];
+		const usz count = scanOam(ly, height, visible);
+
+		if (!count)
+			return false;
+
+		u8 owner[spriteLineLength];
+
+		std::memset(indices, 0, spriteLineLength);
+		std::memset(attributes, 0, spriteLineLength);
+		std::memset(owner, 0xFF, spriteLineLength);
+
+		const u8 *oam = &m.getRef<u8>(0xFE00);
+
+		for (usz i = 0; i < count; ++i) {
+
+			const u8 *sprite = oam + visible[i] * 4;
+			const u8 x = sprite[1], attribute = sprite[3];
+
+			u8 row = u8(ly + 16 - sprite[0]);
+
+			if (attribute & 0x40)
+				row = u8(height - 1 - row);
+
+			const usz tile = height == 16 ? (sprite[2] & 0xFE) + (row >> 3) : sprite[2];
+			const u8 *colors = tileCache.row(tile, row & 7);
+
+			const usz flip = attribute & 0x20 ? 7 : 0;
+
+			for (usz p = 0; p < 8; ++p) {
+
+				const u8 color = colors[p ^ flip];
+				const u8 take = u8(-u8((color != 0) & (x < owner[x + p])));
+
+				indices[x + p] = u8((indices[x + p] & ~take) | (color & take));
+				attributes[x + p] = u8((attributes[x + p] & ~take) | (attribute & take));
+				owner[x + p] = u8((owner[x + p] & ~take) | (x & take));
+			}
+		}
+
+		return true;
+	}
+
+	//Entry of a 4 entry table without branching or indexing, so the loop using it can be vectorized
+
+	static _inline_ u8 pickShade(u8 i, const u8 shades[4]) {
+		return u8(
+			(u8(-u8(i == 0)) & shades[0]) | (u8(-u8(i == 1)) & shades[1]) |
+			(u8(-u8(i == 2)) & shades[2]) | (u8(-u8(i == 3)) & shades[3])
+		);
+	}
+
+	//Cheap hash of a line, only to see whether it's the same as last frame
+
+	static _inline_ u64 hashWord(u64 h, u64 v) {
+		h = (h ^ v) * 0xFF51AFD7ED558CCD;
+		return h ^ (h >> 32);
+	}
+
+	static _inline_ u64 hashWord(u64 h, const u8 *p) {
+		u64 v;
+		std::memcpy(&v, p, sizeof(v));
+		return hashWord(h, v);
+	}
+
+	//4 independent lanes so the multiplies don't wait on each other
+
+	static _inline_ u64 hashLine(const u8 *line, u64 seed) {
+
+		static_assert(specs::width % 32 == 0, "Lines are hashed 32 bytes at a time");
+
+		u64 h0 = seed, h1 = seed + 1, h2 = seed + 2, h3 = seed + 3;
+
+		for (usz i = 0; i < specs::width; i += 32) {
+			h0 = hashWord(h0, line + i);
+			h1 = hashWord(h1, line + i + 8);
+			h2 = hashWord(h2, line + i + 16);
+			h3 = hashWord(h3, line + i + 24);
+		}
+
+		return hashWord(hashWord(hashWord(hashWord(seed, h0), h1), h2), h3);
+	}
+
+	_inline_ void Emulator::markLine(u8 ly, u64 hash) {
+
+		drawnLines.set(ly);
+
+		if (lineHashes[ly] != hash) {
+			lineHashes[ly] = hash;
+			changed.set(ly);
+		}
+	}
+
 	//Render a line of the display
+	//Background and window go into one line of color indices, sprites into another,
+	//then both are merged into shades through the palettes
 
-	_inline_ void Emulator::pushLine(u32 *ppu) {
+	_inline_ void Emulator::pushLine() {
 
-		if (!getFlagFromAddress<io::enableLcd>())
+		if (!target || !getFlagFromAddress<io::enableLcd>())
 			return;
 
-		//TODO: io::bgTileAddr
+		const u8 ly = m.getRef<u8>(io::ly);
 
-		u8
-			ly = m[io::ly],
-			scy = m[io::scy],
-			y = ly + scy,
-			scx = m[io::scx];
+		if (ly >= specs::height)
+			return;
+
+		u8 &windowLine = m.getMemory<u8>(WINDOW_LINE >> 8);
 
-		//Draw background
+		if (ly == 0)
+			windowLine = 0;
 
-		if (getFlagFromAddress<io::enableBg>()) {
+		updateTiles();
 
-			u8 tileY = y >> 3;
-			u8 inTileY = y & 7;
+		static constexpr usz width = specs::width, lineLength = 21 * 8;
 
-			u16 startOffset = getFlagFromAddress<io::bgTileAddr>() ? io::tileMap1 : io::tileMap0;
-			startOffset += tileY << 5;
+		u8 bg[lineLength]{}, window[lineLength];
+		const u8 *line = bg;
 
-			u32 *colors = ppu + ly * specs::width;
+		//Background; BG and window are white when disabled
 
-			for (u8 i = 0; i < specs::width; ++i) {
+		const bool bgEnabled = getFlagFromAddress<io::enableBg>();
+		const bool signedTiles = !getFlagFromAddress<io::bgWindowTileAddr>();
 
-				u8 x = i + scx;
-				u8 tileX = x >> 3;
-				u8 inTileX = x & 7;
-				u8 revInTileX = 7 - inTileX;
+		if (bgEnabled) {
 
-				u8 tile = m.getRef<u8>(startOffset + (tileX & 31));
+			const u8 scx = m.getRef<u8>(io::scx), y = u8(ly + m.getRef<u8>(io::scy));
+
+			drawTiles(bg, getFlagFromAddress<io::bgTileAddr>() ? io::tileMap1 : io::tileMap0, scx >> 3, y, signedTiles);
+			line = bg + (scx & 7);
+		}
 
-				u16 tileAddr = io::tileSet0;	//Get start of tile
-				tileAddr += (inTileY << 1) | (tile << 4_u16);
+		//Window; starts at wx - 7 and covers the rest of the line
 
-				u8 paletteId = (m.getRef<u8>(tileAddr) >> revInTileX) | ((m.getRef<u8>(tileAddr + 1) >> revInTileX) << 1);
+		const u8 wx = m.getRef<u8>(io::wx), wy = m.getRef<u8>(io::wy);
 
-				colors[i] = palette[paletteId];
+		if (bgEnabled && getFlagFromAddress<io::enableWindow>() && ly >= wy && wx < width + 7) {
+
+			drawTiles(window, getFlagFromAddress<io::wndTileAddr>() ? io::tileMap1 : io::tileMap0, 0, windowLine, signedTiles);
+			++windowLine;
+
+			if (line != bg) {
+				std::memmove(bg, line, width);
+				line = bg;
 			}
 
+			const usz start = wx < 7 ? 0 : wx - 7, skip = wx < 7 ? 7 - wx : 0;
+			std::memcpy(bg + start, window + skip, width - start);
+		}
+
+		//Shades (0-3) of the background, OBP0 and OBP1
+
+		const u8 bgp = bgEnabled ? m.getRef<u8>(io::bgp) : 0;
+		const u8 obp0 = m.getRef<u8>(io::obp0), obp1 = m.getRef<u8>(io::obgp1);
+
+		u8 bgShades[4], objShades0[4], objShades1[4];
+		u32 bgColors[4];
+
+		for (usz i = 0; i < 4; ++i) {
+			bgShades[i] = (bgp >> (i * 2)) & 3;
+			objShades0[i] = (obp0 >> (i * 2)) & 3;
+			objShades1[i] = (obp1 >> (i * 2)) & 3;
+			bgColors[i] = palette[bgShades[i]];
+		}
+
+		//Sprites; most lines don't have any, so for RGBA those are colored straight from the background
+
+		u8 spriteIndices[spriteLineLength], spriteAttributes[spriteLineLength];
+
+		const bool sprites = getFlagFromAddress<io::enableSprites>() && drawSprites(ly, spriteIndices, spriteAttributes);
+
+		//The line is hashed before it's written; indices with BGP for RGBA without sprites, otherwise the shades
+
+		if (!sprites && outputFormat == OUTPUT_RGBA) {
+			markLine(ly, hashLine(line, 0x100 | bgp));
+			pixels::best().colorize(line, width, bgColors, (u32*) target + ly * width);
+			return;
+		}
+
+		u8 shades[width];
+
+		if (!sprites)
+			for (usz i = 0; i < width; ++i)
+				shades[i] = pickShade(line[i], bgShades);
+
+		//A sprite pixel shows if it isn't transparent, unless it's behind (attribute bit 7) a non-zero background
+
+		else {
+
+			const u8 *sprite = spriteIndices + 8, *attribute = spriteAttributes + 8;
+
+			for (usz i = 0; i < width; ++i) {
+
+				const u8 b = line[i], s = sprite[i], a = attribute[i];
+
+				const u8 show = u8(-u8((s != 0) & ((a < 0x80) | (b == 0))));
+				const u8 obp1Mask = u8(-u8((a & 0x10) != 0));
+
+				const u8 obj = u8((pickShade(s, objShades0) & ~obp1Mask) | (pickShade(s, objShades1) & obp1Mask));
+
+				shades[i] = u8((pickShade(b, bgShades) & ~show) | (obj & show));
+			}
 		}
 
-		//m[io::ly] = u8(ly + 1);
+		markLine(ly, hashLine(shades, 0));
+		writeLine(ly, shades);
 	}
 
-	//Push blank screen to the immediate buffer
-	//Then push the immediate buffer to the screen buffer
+	//A line of shades to the output
+	//They're merged into a local line first, so the compiler knows it doesn't alias the caller's buffer
+
+	_inline_ void Emulator::writeLine(u8 ly, const u8 *shades) {
 
-	template<bool on>
-	_inline_ void Emulator::pushBlank(u32 *it, u32 *end) {
+		static constexpr usz width = specs::width;
 
-		for (; it < end; ++it)
-			*it = palette[on ? 0 : 4];
+		switch (outputFormat) {
+
+			case OUTPUT_RGBA:
+				pixels::best().colorize(shades, width, palette, (u32*) target + ly * width);
+				break;
+
+			case OUTPUT_SHADES:
+				std::memcpy(target + ly * width, shades, width);
+				break;
+
+			case OUTPUT_PACKED_SHADES: {
+
+				//4 shades as a little endian u32 have their 2 bits at 0, 8, 16 and 24
+
+				u8 *packed = target + ly * (width / 4);
+
+				for (usz i = 0; i < width / 4; ++i) {
+
+					u32 v;
+					std::memcpy(&v, shades + i * 4, sizeof(v));
+
+					packed[i] = u8(v | (v >> 6) | (v >> 12) | (v >> 18));
+				}
 
+				break;
+			}
+
+			default:
+				break;
+		}
 	}
 
-	//Process the PPU
+	//A line that wasn't drawn; the OFF color or shade 0
 
-	_inline_ void Emulator::ppuStep(bool &pushScreen, u32 *ppu) {
+	_inline_ void Emulator::blankLine(u8 ly) {
 
-		enum Modes {
-			HBLANK = 0,			HBLANK_INTERVAL = 204 / 4,
-			VBLANK = 1,			VBLANK_INTERVAL = 456 / 4,
-			OAM = 2,			OAM_INTERVAL = 80 / 4,
-			VRAM = 3,			VRAM_INTERVAL = 172 / 4
-		};
+		static constexpr usz width = specs::width;
 
-		//Push populated frame
+		switch (outputFormat) {
 
-		u8 &lcdc = m.getRef<u8>(io::stat);
-		u8 &ly = m.getRef<u8>(io::ly);
-		u8 mode = lcdc & 3;
+			case OUTPUT_RGBA:
+				std::fill_n((u32*) target + ly * width, width, palette[4]);
+				break;
 
-		switch (mode) {
+			case OUTPUT_SHADES:
+				std::memset(target + ly * width, 0, width);
+				break;
 
-			case HBLANK:
+			case OUTPUT_PACKED_SHADES:
+				std::memset(target + ly * (width / 4), 0, width / 4);
+				break;
 
-				if (ppuCycle >= HBLANK_INTERVAL) {
+			default:
+				break;
+		}
+	}
 
-					++ly;
+	//The target isn't cleared when a frame starts (it could be handed out or read while drawn),
+	//only the lines that weren't drawn are blanked at vblank; usually that's none or one
 
-					//Push to screen and restart vblank
+	_inline_ void Emulator::finishTarget() {
 
-					if (ly == specs::height - 1) {
+		static constexpr u64 blankHash = 0;
 
-						pushScreen = true;
+		for (u8 ly = 0; ly < specs::height; ++ly)
+			if (!drawnLines.test(ly)) {
+				blankLine(ly);
+				markLine(ly, blankHash);
+			}
 
-						m[io::IF] |= 1;		//Signal vblank
-						mode = VBLANK;
-					}
+		if (allLinesChanged) {
 
-					//Start scanline
+			for (u8 ly = 0; ly < specs::height; ++ly)
+				changed.set(ly);
 
-					else mode = OAM;
+			allLinesChanged = false;
+		}
+	}
 
-					goto end;
-				}
+	//PPU modes and how long they take
 
-				return;
+	enum Modes {
+		HBLANK = 0,			HBLANK_INTERVAL = 204 / 4,
+		VBLANK = 1,			VBLANK_INTERVAL = 456 / 4,
+		OAM = 2,			OAM_INTERVAL = 80 / 4,
+		VRAM = 3,			VRAM_INTERVAL = 172 / 4
+	};
 
-			case VBLANK:
+	static constexpr usz ppuIntervals[] = { HBLANK_INTERVAL, VBLANK_INTERVAL, OAM_INTERVAL, VRAM_INTERVAL };
 
-				if (ppuCycle >= VBLANK_INTERVAL) {
+	//Switch the PPU to the next mode and schedule the transition after that
+	//The mode is kept in PPU_STAT, since the game can write STAT
 
-					++ly;
+	_inline_ void Emulator::ppuEvent(u64 at, bool &pushScreen) {
 
-					if (ly > 153) {
-						mode = OAM;
-						ly = 0;
-					}
+		u8 &stat = m.getRef<u8>(io::stat);
+		u8 &ppuStat = m.getMemory<u8>(PPU_STAT >> 8);
+		u8 &ly = m.getRef<u8>(io::ly);
+		u8 mode = ppuStat & 3;
 
-					goto end;
-				}
+		switch (mode) {
 
-				return;
+			case HBLANK:
 
-			case OAM:
+				++ly;
+
+				//Push to screen and restart vblank; the lines that weren't drawn are blanked
+
+				if (ly == specs::height - 1) {
+
+					pushScreen = true;
+
+					if (target)
+						finishTarget();
 
-				if (ppuCycle >= OAM_INTERVAL) {
-					mode = VRAM;
-					goto end;
+					requestInterrupt(1);		//Signal vblank
+					mode = VBLANK;
 				}
 
-				return;
+				//Start scanline
 
-			case VRAM:
+				else mode = OAM;
+
+				break;
+
+			case VBLANK:
 
-				if (ppuCycle >= VRAM_INTERVAL) {
-					pushLine(ppu);
-					mode = HBLANK;
-					goto end;
+				++ly;
+
+				//A new frame starts; frame, run and step all go through here
+
+				if (ly > 153) {
+					mode = OAM;
+					ly = 0;
+					drawnLines = {};
+					changed = {};
 				}
 
-				return;
+				break;
 
-			end:
+			case OAM:
+				mode = VRAM;
+				break;
 
-				ppuCycle = 0;
-				lcdc &= ~3;
-				lcdc |= mode;
+			case VRAM:
+				pushLine();
+				mode = HBLANK;
+				break;
 		}
 
+		//STAT interrupt; requested when one of the enabled conditions starts (the STAT line goes high)
+		//Bits 3-5 enable HBlank, VBlank and OAM, bit 6 LY=LYC; LYC writes are seen at the next event
+
+		const u8 coincidence = ly == m.getRef<u8>(io::lyc) ? 4 : 0;
+		const bool line = (stat & 0x40 && coincidence) || (mode != VRAM && stat & (0x08 << mode));
+
+		if (line && !(ppuStat & 0x80))
+			requestInterrupt(2);
+
+		ppuStat = u8(line << 7 | coincidence | mode);
+		stat = u8((stat & ~7) | coincidence | mode);
+
+		scheduler.schedule(EVENT_PPU, at + ppuIntervals[mode]);
 	}
 
 }
\ No newline at end of file
@@ -0,0 +1,65 @@
+#pragma once
+#include "gb/emulator.hpp"
+
+namespace gb {
+
+	//Per-frame history of an emulator in a fixed memory budget
+	//Every frame is stored as the XOR of its state with the previous one, compressed as runs and literals
+	//Every keyframeInterval frames the full state is stored instead, so a seek never decodes more than one interval
+	//Nothing is emulated when going back and nothing is allocated after creation
+
+	struct Rewind {
+
+		struct Info {
+			usz budget = 32_MiB;						//Bytes of compressed history; the oldest frames are dropped
+			usz maxFrames = 60 * 60 * 10;				//Frames of history (10 minutes)
+			usz keyframeInterval = 60;					//Frames between full states
+		};
+
+		static constexpr f64 framesPerSecond = 59.7275;
+
+		explicit Rewind(Emulator &e);
+		Rewind(Emulator &e, const Info &info);
+
+		Rewind(const Rewind&) = delete;
+		Rewind &operator=(const Rewind&) = delete;
+
+		//Store the current state (once per frame)
+
+		void push();
+
+		//Restore the state of n pushes ago and drop everything after it
+		//0 restores the last pushed state; returns false if the history doesn't go back that far
+
+		bool stepBack(usz frames = 1);
+		bool stepBackSeconds(f64 seconds);
+
+		void clear();
+
+		usz frames() const { return count; }
+		usz memoryUsed() const;
+
+	private:
+
+		struct Entry {
+			usz offset, size;
+			bool keyframe;
+		};
+
+		Entry &entry(usz i) { return entries[(first + i) % entries.size()]; }
+		const Entry &entry(usz i) const { return entries[(first + i) % entries.size()]; }
+
+		u8 *allocate(usz size);
+		void evict();
+
+		Emulator &emu;
+		Info info;
+
+		List<u8> ring, state, next, scratch;
+		List<Entry> entries;
+
+		usz first{}, count{}, end{};
+		usz sinceKeyframe{};
+	};
+
+}
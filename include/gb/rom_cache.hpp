@@ -0,0 +1,60 @@
+#pragma once
+#include "types/types.hpp"
+#include <memory>
+
+namespace gb {
+
+	//Read-only image of a ROM or BIOS, shared by every emulator that runs it
+	//The size is a multiple of a ROM bank, padded with zeros if the file isn't
+
+	struct RomImage {
+
+		RomImage() = default;
+		~RomImage();
+
+		RomImage(const RomImage&) = delete;
+		RomImage &operator=(const RomImage&) = delete;
+
+		const u8 *data() const { return ptr; }
+		usz size() const { return length; }
+		usz contentSize() const { return content; }	//Size of the file or buffer, before padding
+		u64 hash() const { return key; }
+
+		bool mapped() const { return view != nullptr; }
+
+	private:
+
+		friend struct RomCache;
+
+		const u8 *ptr{};
+		usz length{}, content{};
+		u64 key{};
+
+		void *view{};				//Mapping of the file, or null if the image is a copy
+		usz viewLength{};
+
+		Buffer copy;
+	};
+
+	//Process-wide cache of images keyed by their content
+	//Files are memory mapped, so instances in different processes share the pages of the OS file cache too
+	//Entries are weak; an image is unmapped once the last emulator using it is gone
+
+	struct RomCache {
+
+		static constexpr usz alignment = 16_KiB;
+
+		//nullptr if the file can't be read or is empty
+
+		static std::shared_ptr<const RomImage> open(const char *path);
+
+		//Copies the buffer, unless an image with the same content exists
+
+		static std::shared_ptr<const RomImage> get(const Buffer &buffer);
+
+		//Images that are still in use
+
+		static usz size();
+	};
+
+}
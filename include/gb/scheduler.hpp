@@ -0,0 +1,73 @@
+#pragma once
+#include "types/types.hpp"
+
+namespace gb {
+
+	//Hardware that has to do something at a specific cycle
+
+	enum Event : u8 {
+		EVENT_PPU,				//PPU mode transition
+		EVENT_DIV,				//DIV increment
+		EVENT_TIMER,			//TIMA increment (overflow requests the timer interrupt)
+		EVENT_DMA,				//OAM DMA completion
+		EVENT_SERIAL,			//Serial transfer completion
+		EVENT_RTC,				//MBC3 clock tick
+		EVENT_COUNT
+	};
+
+	//One deadline per event; the earliest is cached, so the cpu only has to compare against one cycle
+
+	struct Scheduler {
+
+		static constexpr u64 never = u64_MAX;
+
+		u64 deadlines[EVENT_COUNT];
+
+		u64 next = never;
+		Event nextEvent = EVENT_PPU;
+		u8 padding[7]{};						//Saved states copy the struct as is, so it has to be zero
+
+		Scheduler() {
+			for (u64 &deadline : deadlines)
+				deadline = never;
+		}
+
+		_inline_ void schedule(Event e, u64 at) {
+
+			deadlines[e] = at;
+
+			if (at <= next) {
+				next = at;
+				nextEvent = e;
+			}
+
+			else if (e == nextEvent)
+				update();
+		}
+
+		_inline_ void cancel(Event e) {
+			schedule(e, never);
+		}
+
+		//Remove the earliest event, so it can schedule itself again
+
+		_inline_ Event pop() {
+			const Event e = nextEvent;
+			deadlines[e] = never;
+			update();
+			return e;
+		}
+
+		_inline_ void update() {
+
+			next = never;
+
+			for (u8 i = 0; i < EVENT_COUNT; ++i)
+				if (deadlines[i] < next) {
+					next = deadlines[i];
+					nextEvent = Event(i);
+				}
+		}
+	};
+
+}
@@ -0,0 +1,165 @@
+
+namespace gb {
+
+	static constexpr u64
+		divPeriod = 64,						//16384 Hz
+		dmaDuration = 160,					//One byte per cycle
+		serialDuration = 8 * 128,			//8 bits at 8192 Hz
+		rtcPeriod = 1 << 20;				//1 Hz
+
+	static constexpr u64 timerPeriods[] = { 256, 4, 16, 64 };		//4096, 262144, 65536 and 16384 Hz
+
+	//Run the cpu until the budget is used up, or until it wrote something the scheduler has to handle
+
+	_inline_ usz Emulator::cpuRun(usz budget) {
+
+		//Nothing can wake up the cpu before the next event
+
+		if (getFlag<Emulator::IS_HALTED>())
+			return budget;
+
+		u8 &pending = m.getMemory<u8>(Emulator::SCHEDULE >> 8);
+		constexpr u8 idleLoop = Emulator::IDLE_LOOP & 0xFF;
+
+		usz cycles{};
+
+		while (cycles < budget) {
+
+			while (cycles < budget && !pending)
+				switch (cpuMode) {
+
+					case BLOCK_CACHE:	cycles += blockStep(budget - cycles);		break;
+
+					default:
+
+						#ifdef GB_THREADED_DISPATCH
+							cycles += threadedStep(budget - cycles);
+						#else
+							cycles += cpuStep();
+						#endif
+				}
+
+			//Anything but an idle loop has to go through the scheduler
+
+			if (pending != idleLoop)
+				break;
+
+			pending = 0;
+
+			if (cycles < budget)
+				cycles += skipIdleLoop(budget - cycles);
+		}
+
+		return cycles;
+	}
+
+	_inline_ void Emulator::requestInterrupt(u8 mask) {
+		m.getRef<u8>(io::IF) |= mask;
+		setFlag<true, Emulator::CHECK_INTERRUPTS>();
+	}
+
+	//Run all events that are due and handle the writes the cpu stopped for
+
+	_inline_ void Emulator::runEvents(bool &pushScreen) {
+
+		const u8 &pending = m.getMemory<u8>(Emulator::SCHEDULE >> 8);
+
+		do {
+
+			while (scheduler.next <= cycle) {
+
+				const u64 at = scheduler.next;
+
+				switch (scheduler.pop()) {
+					case EVENT_PPU:		ppuEvent(at, pushScreen);			break;
+					case EVENT_DIV:		++m.getRef<u8>(io::div);
+										scheduler.schedule(EVENT_DIV, at + divPeriod);
+										break;
+					case EVENT_TIMER:	timerEvent(at);						break;
+					case EVENT_DMA:		dmaEvent();							break;
+					case EVENT_SERIAL:	serialEvent();						break;
+					case EVENT_RTC:		MemoryMapper::tickRtc(&m);
+										scheduler.schedule(EVENT_RTC, at + rtcPeriod);
+										break;
+					default:												break;
+				}
+			}
+
+			if (pending)
+				handleWrites();
+
+		} while (scheduler.next <= cycle || pending);
+	}
+
+	_inline_ void Emulator::handleWrites() {
+
+		u8 &pending = m.getMemory<u8>(Emulator::SCHEDULE >> 8);
+		const u8 writes = pending;
+		pending = 0;
+
+		if (writes & (Emulator::DIV_RESET & 0xFF)) {
+			divBase = cycle;
+			scheduler.schedule(EVENT_DIV, cycle + divPeriod);
+		}
+
+		if (writes & (Emulator::TIMER_CHANGED & 0xFF))
+			scheduleTimer();
+
+		if (writes & (Emulator::DMA_STARTED & 0xFF))
+			scheduler.schedule(EVENT_DMA, cycle + dmaDuration);
+
+		//Only an internal clock will ever finish, as there's nothing on the other side of the link cable
+
+		if (writes & (Emulator::SERIAL_STARTED & 0xFF) && m.getRef<u8>(io::transferControl) & 1)
+			scheduler.schedule(EVENT_SERIAL, cycle + serialDuration);
+
+		if (writes & (Emulator::CHECK_INTERRUPTS & 0xFF))
+			cycle += interruptHandler();
+	}
+
+	//Timer
+
+	_inline_ void Emulator::scheduleTimer() {
+
+		const u8 tac = m.getRef<u8>(io::tac);
+
+		if (!(tac & 4)) {
+			scheduler.cancel(EVENT_TIMER);
+			return;
+		}
+
+		const u64 period = timerPeriods[tac & 3];
+		scheduler.schedule(EVENT_TIMER, divBase + ((cycle - divBase) / period + 1) * period);
+	}
+
+	_inline_ void Emulator::timerEvent(u64 at) {
+
+		u8 &tima = m.getRef<u8>(io::tima);
+
+		if (!++tima) {
+			tima = m.getRef<u8>(io::tma);
+			requestInterrupt(4);
+		}
+
+		scheduler.schedule(EVENT_TIMER, at + timerPeriods[m.getRef<u8>(io::tac) & 3]);
+	}
+
+	//Copy 160 bytes into OAM
+
+	_inline_ void Emulator::dmaEvent() {
+
+		const u16 src = u16(m.getRef<u8>(io::dma) << 8);
+
+		for (u16 i = 0; i < 160; ++i)
+			m.getRef<u8>(0xFE00 + i) = m.get<u8>(src + i);
+
+		MemoryMapper::markDirty(&m, m.host(MemoryMapper::mapping | 0xFE00));
+	}
+
+	_inline_ void Emulator::serialEvent() {
+		m.getRef<u8>(io::data) = 0xFF;
+		m.getRef<u8>(io::transferControl) &= 0x7F;
+		requestInterrupt(8);
+	}
+
+}
@@ -0,0 +1,243 @@
+namespace gb {
+
+	//Save states
+
+	//Layout: header, registers, cycles, frames, scheduler, MMU variables, then the memory
+	//Full states store video RAM, [0xC000, 0x10000> and the RAM banks
+	//Delta states store the I/O page (the hardware writes it directly) and every dirty page as (page, 256 bytes)
+	//The ROM area and external RAM of the cpu memory aren't used (the page table points into the banks)
+
+	struct StateHeader {
+
+		static constexpr u32
+			magic = 0x54534247,			//"GBST"
+			deltaMagic = 0x44534247;	//"GBSD"
+
+		static constexpr u16 version = 5;
+
+		u32 id;
+		u16 ver;
+		u8 type, checksum;				//Cartridge type and header checksum of the ROM it belongs to
+		u8 ramBanks;
+		u8 padding[7];
+	};
+
+	static constexpr usz
+
+		stateVram = 0x8000,
+		stateVramLength = 0x2000,
+
+		stateWram = 0xC000,
+		stateWramLength = 0x4000,
+
+		statePage = 256,
+		stateCpuPages = 0x80,												//Dirty pages of the cpu memory are [0x80, 0xFF>
+		stateRamPages = (MemoryMapper::ramStart - MemoryMapper::cpuStart) >> 8;
+
+	_inline_ usz stateRamLength(Memory &m) {
+		return usz(m.getMemory<u8>(Emulator::RAM_BANKS >> 8)) * 8_KiB;
+	}
+
+	_inline_ usz stateFixedLength(Emulator &e) {
+		return sizeof(StateHeader) + sizeof(e.lregs) + sizeof(e.cycle) + sizeof(e.frames) + sizeof(e.divBase) + sizeof(e.scheduler) + MemoryMapper::mmuLength;
+	}
+
+	_inline_ StateHeader stateHeader(Memory &m, u32 magic) {
+		return StateHeader {
+			magic, StateHeader::version,
+			m.rom()[0x147], m.rom()[0x14D],
+			m.getMemory<u8>(Emulator::RAM_BANKS >> 8), {}
+		};
+	}
+
+	_inline_ bool stateMatches(Memory &m, const StateHeader &header, u32 magic) {
+		return
+			header.id == magic && header.ver == StateHeader::version &&
+			header.type == m.rom()[0x147] &&
+			header.checksum == m.rom()[0x14D] &&
+			header.ramBanks == m.getMemory<u8>(Emulator::RAM_BANKS >> 8);
+	}
+
+	_inline_ void statePut(u8 *&state, const void *src, usz length) {
+		std::memcpy(state, src, length);
+		state += length;
+	}
+
+	_inline_ void stateGet(const u8 *&state, void *dst, usz length) {
+		std::memcpy(dst, state, length);
+		state += length;
+	}
+
+	_inline_ void saveFixed(Emulator &e, u8 *&state, u32 magic) {
+
+		const StateHeader header = stateHeader(e.m, magic);
+
+		statePut(state, &header, sizeof(header));
+		statePut(state, e.lregs, sizeof(e.lregs));
+		statePut(state, &e.cycle, sizeof(e.cycle));
+		statePut(state, &e.frames, sizeof(e.frames));
+		statePut(state, &e.divBase, sizeof(e.divBase));
+		statePut(state, &e.scheduler, sizeof(e.scheduler));
+		statePut(state, &e.m.getMemory<u8>(MemoryMapper::mmuStart), MemoryMapper::mmuLength);
+	}
+
+	_inline_ void loadFixed(Emulator &e, const u8 *&state) {
+		stateGet(state, e.lregs, sizeof(e.lregs));
+		stateGet(state, &e.cycle, sizeof(e.cycle));
+		stateGet(state, &e.frames, sizeof(e.frames));
+		stateGet(state, &e.divBase, sizeof(e.divBase));
+		stateGet(state, &e.scheduler, sizeof(e.scheduler));
+		stateGet(state, &e.m.getMemory<u8>(MemoryMapper::mmuStart), MemoryMapper::mmuLength);
+	}
+
+	//Everything decoded from writable memory is invalidated by bumping the write generations,
+	//blocks of the ROM stay valid, since their keys include the bank
+
+	_inline_ void stateLoaded(Memory &m) {
+
+		MemoryMapper::remap(&m);
+
+		u32 *gen = &m.getMemory<u32>(MemoryMapper::codeGenStart);
+
+		for (usz i = 0; i < MemoryMapper::codeGenLength / sizeof(u32); ++i)
+			++gen[i];
+
+		std::memset(&m.getMemory<u8>(MemoryMapper::dirtyStart), 0, MemoryMapper::dirtyLength);
+	}
+
+	//Full states
+
+	usz Emulator::stateSize() {
+		return stateFixedLength(*this) + stateVramLength + stateWramLength + stateRamLength(m);
+	}
+
+	bool Emulator::saveState(u8 *state, usz size) {
+
+		if (size < stateSize())
+			return false;
+
+		saveFixed(*this, state, StateHeader::magic);
+		statePut(state, &m.getRef<u8>(stateVram), stateVramLength);
+		statePut(state, &m.getRef<u8>(stateWram), stateWramLength);
+		statePut(state, &m.getMemory<u8>(MemoryMapper::ramStart), stateRamLength(m));
+
+		std::memset(&m.getMemory<u8>(MemoryMapper::dirtyStart), 0, MemoryMapper::dirtyLength);
+		return true;
+	}
+
+	bool Emulator::loadState(const u8 *state, usz size) {
+
+		if (size < stateSize())
+			return false;
+
+		StateHeader header;
+		stateGet(state, &header, sizeof(header));
+
+		if (!stateMatches(m, header, StateHeader::magic))
+			return false;
+
+		loadFixed(*this, state);
+		stateGet(state, &m.getRef<u8>(stateVram), stateVramLength);
+		stateGet(state, &m.getRef<u8>(stateWram), stateWramLength);
+		stateGet(state, &m.getMemory<u8>(MemoryMapper::ramStart), stateRamLength(m));
+
+		stateLoaded(m);
+		return true;
+	}
+
+	//Delta states
+
+	usz Emulator::deltaStateSize() {
+
+		const usz pages = stateCpuPages - 1 + stateRamLength(m) / statePage;
+
+		return stateFixedLength(*this) + statePage + sizeof(u16) + pages * (sizeof(u16) + statePage);
+	}
+
+	usz Emulator::saveDeltaState(u8 *state, usz size) {
+
+		u8 *dirty = &m.getMemory<u8>(MemoryMapper::dirtyStart);
+		const usz ramPages = stateRamLength(m) / statePage;
+
+		usz pages{};
+
+		for (usz i = stateCpuPages; i < 0xFF; ++i)
+			pages += dirty[i];
+
+		for (usz i = 0; i < ramPages; ++i)
+			pages += dirty[stateRamPages + i];
+
+		const usz length = stateFixedLength(*this) + statePage + sizeof(u16) + pages * (sizeof(u16) + statePage);
+
+		if (size < length)
+			return 0;
+
+		const u8 *start = state;
+
+		saveFixed(*this, state, StateHeader::deltaMagic);
+		statePut(state, &m.getRef<u8>(0xFF00), statePage);
+
+		const u16 count = u16(pages);
+		statePut(state, &count, sizeof(count));
+
+		auto putPage = [&state](u16 page, const u8 *mem) {
+			statePut(state, &page, sizeof(page));
+			statePut(state, mem, statePage);
+		};
+
+		for (usz i = stateCpuPages; i < 0xFF; ++i)
+			if (dirty[i])
+				putPage(u16(i), &m.getRef<u8>(u16(i << 8)));
+
+		for (usz i = 0; i < ramPages; ++i)
+			if (dirty[stateRamPages + i])
+				putPage(u16(stateRamPages + i), &m.getMemory<u8>(MemoryMapper::ramStart + i * statePage));
+
+		std::memset(dirty, 0, MemoryMapper::dirtyLength);
+		return usz(state - start);
+	}
+
+	bool Emulator::loadDeltaState(const u8 *state, usz size) {
+
+		const usz fixed = stateFixedLength(*this) + statePage + sizeof(u16);
+
+		if (size < fixed)
+			return false;
+
+		StateHeader header;
+		stateGet(state, &header, sizeof(header));
+
+		if (!stateMatches(m, header, StateHeader::deltaMagic))
+			return false;
+
+		u16 count;
+		std::memcpy(&count, state + (fixed - sizeof(header) - sizeof(count)), sizeof(count));
+
+		if (size < fixed + usz(count) * (sizeof(u16) + statePage))
+			return false;
+
+		const usz ramPages = stateRamLength(m) / statePage;
+
+		loadFixed(*this, state);
+		stateGet(state, &m.getRef<u8>(0xFF00), statePage);
+		state += sizeof(count);
+
+		for (usz i = 0; i < count; ++i) {
+
+			u16 page;
+			stateGet(state, &page, sizeof(page));
+
+			if (page >= stateCpuPages && page < 0xFF)
+				stateGet(state, &m.getRef<u8>(u16(page << 8)), statePage);
+
+			else if (page >= stateRamPages && page < stateRamPages + ramPages)
+				stateGet(state, &m.getMemory<u8>(MemoryMapper::ramStart + (page - stateRamPages) * statePage), statePage);
+
+			else state += statePage;
+		}
+
+		stateLoaded(m);
+		return true;
+	}
+
+}
@@ -0,0 +1,75 @@
+#ifdef GB_THREADED_DISPATCH
+
+#ifndef __GNUC__
+	#error GB_THREADED_DISPATCH requires labels as values (GCC or Clang)
+#endif
+
+namespace gb {
+
+	#pragma GCC diagnostic push
+	#pragma GCC diagnostic ignored "-Wpedantic"
+
+	//Instructions that change interrupt state have to return to the scheduler
+
+	static constexpr bool endsChain(u8 i) {
+		return i == DI || i == EI || i == HALT || i == STOP || i == 0xD9;
+	}
+
+	//For our label tables of 256 entries; h and l are the hex digits of the opcode
+	#define hexRow(x,h) x(h,0) x(h,1) x(h,2) x(h,3) x(h,4) x(h,5) x(h,6) x(h,7) x(h,8) x(h,9) x(h,A) x(h,B) x(h,C) x(h,D) x(h,E) x(h,F)
+	#define hexTable(x) hexRow(x,0) hexRow(x,1) hexRow(x,2) hexRow(x,3) hexRow(x,4) hexRow(x,5) hexRow(x,6) hexRow(x,7) hexRow(x,8) hexRow(x,9) hexRow(x,A) hexRow(x,B) hexRow(x,C) hexRow(x,D) hexRow(x,E) hexRow(x,F)
+
+	#define threadedOpLabel(h,l) &&op_##h##l,
+	#define threadedCbLabel(h,l) &&cb_##h##l,
+
+	#define threadedNext(i)								\
+		if constexpr (endsChain(i)) return cycles;		\
+		if (cycles >= budget || pending) return cycles;	\
+		opCode = m[pc];									\
+		++pc;											\
+		goto *ops[opCode];
+
+	#define threadedOp(h,l) op_##h##l:					\
+		if constexpr (0x##h##l == 0xCB) {				\
+			opCode = m[pc];								\
+			++pc;										\
+			goto *cbs[opCode];							\
+		} else {										\
+			cycles += op256<0x##h##l>();				\
+			threadedNext(0x##h##l)						\
+		}
+
+	#define threadedCb(h,l) cb_##h##l:					\
+		cycles += opCb<0x##h##l>();						\
+		threadedNext(0xCB)
+
+	//Chain instructions until the budget is used up, without returning to the scheduler
+
+	_inline_ usz Emulator::threadedStep(usz budget) {
+
+		//The BIOS has to be unmapped once pc leaves it, which cpuStep handles
+
+		if (getFlag<Emulator::IS_IN_BIOS>())
+			return cpuStep();
+
+		static void *const ops[256] = { hexTable(threadedOpLabel) };
+		static void *const cbs[256] = { hexTable(threadedCbLabel) };
+
+		const u8 &pending = m.getMemory<u8>(Emulator::SCHEDULE >> 8);
+		usz cycles{};
+
+		u8 opCode = m[pc];
+		++pc;
+		goto *ops[opCode];
+
+		hexTable(threadedOp)
+		hexTable(threadedCb)
+
+		return cycles;
+	}
+
+	#pragma GCC diagnostic pop
+
+}
+
+#endif
@@ -0,0 +1,26 @@
+#pragma once
+#include "types/types.hpp"
+
+namespace gb {
+
+	//Tile data of [0x8000, 0x9800> decoded to a color index (0-3) per pixel, 8 bytes per row
+	//Pages are decoded again once their write generation (the one of the block cache) changed,
+	//so writes to VRAM don't have to do anything and loaded states or forks are picked up as well
+
+	struct TileCache {
+
+		static constexpr usz
+			tiles = 384,
+			tileSize = 8 * 8,
+			tilesPerPage = 256 / 16,					//16 bytes per tile
+			pages = tiles / tilesPerPage;
+
+		List<u8> pixels;							//tiles * tileSize, empty until the first line is drawn
+		u32 gens[pages]{};
+
+		_inline_ const u8 *row(usz tile, usz y) const {
+			return pixels.data() + tile * tileSize + y * 8;
+		}
+	};
+
+}
@@ -0,0 +1,236 @@
+#include "gb/batch.hpp"
+#include <algorithm>
+
+#ifdef _WIN32
+	#define WIN32_LEAN_AND_MEAN
+	#define NOMINMAX
+	#include <Windows.h>
+#elif defined(__linux__)
+	#include <pthread.h>
+	#include <sched.h>
+#endif
+
+namespace gb {
+
+	static constexpr u64 cyclesPerFrame = 70224 / 4;
+
+	static void pinThread(usz core) {
+
+		#ifdef _WIN32
+			SetThreadAffinityMask(GetCurrentThread(), DWORD_PTR(1) << (core % (sizeof(DWORD_PTR) * 8)));
+		#elif defined(__linux__)
+			cpu_set_t set;
+			CPU_ZERO(&set);
+			CPU_SET(core % CPU_SETSIZE, &set);
+			pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+		#else
+			(void)core;
+		#endif
+	}
+
+	Batch::Batch(): Batch(Info()) {}
+
+	Batch::Batch(const Info &inf): info(inf) {
+
+		const usz threads = info.threads ? info.threads : std::max(std::thread::hardware_concurrency(), 1u);
+
+		for (usz i = 0; i < threads; ++i)
+			workers.push_back(std::make_unique<Worker>());
+
+		for (usz i = 0; i < threads; ++i)
+			workers[i]->thread = std::thread(&Batch::work, this, i);
+	}
+
+	Batch::~Batch() {
+
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			stopping = true;
+		}
+
+		start.notify_all();
+
+		for (auto &worker : workers)
+			worker->thread.join();
+	}
+
+	usz Batch::add(const Buffer &rom, const Buffer &bios, Callback onComplete) {
+		return add(RomCache::get(rom), RomCache::get(bios), std::move(onComplete));
+	}
+
+	usz Batch::add(std::shared_ptr<const RomImage> rom, std::shared_ptr<const RomImage> bios, Callback onComplete) {
+		instances.push_back(std::make_unique<Instance>(Instance{ std::move(rom), std::move(bios), std::move(onComplete), {}, 0 }));
+		return instances.size() - 1;
+	}
+
+	void Batch::runFrames(u64 frames) {
+		run(frames, true);
+	}
+
+	void Batch::runCycles(u64 cycles) {
+		run(cycles, false);
+	}
+
+	//Instances start out on the same worker every run, so they tend to stay in the same cache
+
+	void Batch::run(u64 amount, bool frames) {
+
+		if (instances.empty() || !amount)
+			return;
+
+		//Workers still waiting from the last run can pick up work as soon as it's queued,
+		//so the mode, budgets and count are all set before anything is pushed
+
+		{
+			std::lock_guard<std::mutex> guard(lock);
+
+			runsFrames = frames;
+
+			for (auto &instance : instances)
+				instance->left = amount;
+
+			remaining = instances.size();
+			++round;
+		}
+
+		for (usz i = 0; i < instances.size(); ++i)
+			push(i % workers.size(), i);
+
+		start.notify_all();
+
+		std::unique_lock<std::mutex> guard(lock);
+		done.wait(guard, [this] { return !remaining; });
+	}
+
+	//Own queue from the front, others from the back
+
+	bool Batch::pop(usz worker, usz &id) {
+
+		for (usz i = 0, j = workers.size(); i < j; ++i) {
+
+			Worker &w = *workers[(worker + i) % j];
+			std::lock_guard<std::mutex> guard(w.lock);
+
+			if (w.queue.empty())
+				continue;
+
+			if (!i) {
+				id = w.queue.front();
+				w.queue.pop_front();
+			}
+
+			else {
+				id = w.queue.back();
+				w.queue.pop_back();
+			}
+
+			--queued;
+			return true;
+		}
+
+		return false;
+	}
+
+	void Batch::push(usz worker, usz id) {
+
+		{
+			Worker &w = *workers[worker];
+			std::lock_guard<std::mutex> guard(w.lock);
+			w.queue.push_front(id);
+		}
+
+		//Counted under the batch lock, so a worker can't miss it between checking and waiting
+
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			++queued;
+		}
+
+		ready.notify_one();
+	}
+
+	//Returns whether or not the instance has to run again
+
+	bool Batch::runSlice(Instance &instance) {
+
+		if (!instance.emu) {
+			instance.emu = std::make_unique<Emulator>(instance.rom, instance.bios);
+			instance.emu->cpuMode = info.cpuMode;
+			instance.emu->renderEvery = info.renderEvery;
+			instance.rom.reset();
+			instance.bios.reset();
+		}
+
+		Emulator &emu = *instance.emu;
+
+		if (runsFrames) {
+
+			const u64 frames = std::min(instance.left, info.sliceFrames);
+
+			for (u64 i = 0; i < frames; ++i)
+				emu.frameNoSync({});
+
+			instance.left -= frames;
+		}
+
+		else {
+			const u64 begin = emu.cycle;
+			emu.run(std::min(instance.left, info.sliceFrames * cyclesPerFrame));
+			instance.left -= std::min(instance.left, emu.cycle - begin);
+		}
+
+		return instance.left;
+	}
+
+	void Batch::work(usz worker) {
+
+		if (info.pinThreads)
+			pinThread(worker);
+
+		u64 seen{};
+
+		for (;;) {
+
+			{
+				std::unique_lock<std::mutex> guard(lock);
+				start.wait(guard, [&] { return stopping || round != seen; });
+
+				if (stopping)
+					return;
+
+				seen = round;
+			}
+
+			//Keep stealing until the last instance is done, since slices go back into the queues
+			//With nothing left to steal, sleep until a slice is queued again or the run is over
+
+			while (remaining) {
+
+				usz id;
+
+				if (!pop(worker, id)) {
+					std::unique_lock<std::mutex> guard(lock);
+					ready.wait(guard, [this] { return !remaining || queued; });
+					continue;
+				}
+
+				Instance &instance = *instances[id];
+
+				if (runSlice(instance)) {
+					push(worker, id);
+					continue;
+				}
+
+				if (instance.onComplete)
+					instance.onComplete(id, *instance.emu);
+
+				if (!--remaining) {
+					std::lock_guard<std::mutex> guard(lock);
+					ready.notify_all();
+					done.notify_all();
+				}
+			}
+		}
+	}
+
+}
@@ -0,0 +1,162 @@
+#include "gb/delta.hpp"
+#include <algorithm>
+#include <cstring>
+
+namespace gb::delta {
+
+	//A token byte has the run bit (7) and length - 1 (0-0x7E), or 0x7F followed by a u16 of length - 0x80
+	//Runs store the repeated byte, literals store the bytes themselves
+	//Runs of 0 cost 4 bytes per 64 KiB and are skipped when applied
+
+	static constexpr usz minRun = 4, shortLength = 0x7F, maxLength = 0x80 + 0xFFFF;
+
+	//Runs never take more than they cover and literals take a token per 64 KiB, so this is generous
+
+	usz bound(usz size) {
+		return size + size / 2 + 16;
+	}
+
+	static _inline_ u64 load64(const u8 *p) {
+		u64 v;
+		std::memcpy(&v, p, sizeof(v));
+		return v;
+	}
+
+	static _inline_ u8 *putToken(u8 *out, bool run, usz length) {
+
+		if (length <= shortLength) {
+			*out++ = u8(u8(run) << 7 | (length - 1));
+			return out;
+		}
+
+		const usz extended = length - 0x80;
+
+		*out++ = u8(u8(run) << 7 | shortLength);
+		*out++ = u8(extended);
+		*out++ = u8(extended >> 8);
+		return out;
+	}
+
+	template<bool hasBase>
+	static usz compressWith(const u8 *a, const u8 *b, usz size, u8 *out) {
+
+		auto byte = [a, b](usz i) -> u8 {
+			if constexpr (hasBase) return a[i] ^ b[i];
+			else return a[i];
+		};
+
+		auto word = [a, b](usz i) -> u64 {
+			if constexpr (hasBase) return load64(a + i) ^ load64(b + i);
+			else return load64(a + i);
+		};
+
+		u8 *const start = out;
+		usz i{}, literal{};
+
+		auto putLiterals = [&](usz to) {
+
+			while (literal < to) {
+
+				const usz length = std::min(to - literal, maxLength);
+				out = putToken(out, false, length);
+
+				for (usz j = 0; j < length; ++j)
+					out[j] = byte(literal + j);
+
+				out += length;
+				literal += length;
+			}
+		};
+
+		while (i < size) {
+
+			const u8 x = byte(i);
+			const u64 pattern = u64(x) * 0x0101010101010101;
+
+			usz j = i + 1;
+
+			while (j + 8 <= size && word(j) == pattern)
+				j += 8;
+
+			while (j < size && byte(j) == x)
+				++j;
+
+			if (j - i < minRun) {
+				++i;
+				continue;
+			}
+
+			putLiterals(i);
+
+			for (usz length; i < j; i += length) {
+				length = std::min(j - i, maxLength);
+				out = putToken(out, true, length);
+				*out++ = x;
+			}
+
+			literal = j;
+		}
+
+		putLiterals(size);
+		return usz(out - start);
+	}
+
+	usz compress(const u8 *a, const u8 *base, usz size, u8 *out) {
+		return base ? compressWith<true>(a, base, size, out) : compressWith<false>(a, nullptr, size, out);
+	}
+
+	//Data isn't trusted (it can come from a file), so every token is checked against both ends
+
+	bool apply(const u8 *in, usz size, u8 *dst, usz dstSize) {
+
+		const u8 *const end = in + size;
+		u8 *const dstEnd = dst + dstSize;
+
+		while (in < end) {
+
+			const u8 token = *in++;
+			usz length = token & shortLength;
+
+			if (length < shortLength)
+				++length;
+
+			else {
+
+				if (end - in < 2)
+					return false;
+
+				length = 0x80 + usz(in[0] | in[1] << 8);
+				in += 2;
+			}
+
+			if (usz(dstEnd - dst) < length)
+				return false;
+
+			if (token & 0x80) {
+
+				if (in == end)
+					return false;
+
+				if (const u8 x = *in++)
+					for (usz j = 0; j < length; ++j)
+						dst[j] ^= x;
+			}
+
+			else {
+
+				if (usz(end - in) < length)
+					return false;
+
+				for (usz j = 0; j < length; ++j)
+					dst[j] ^= in[j];
+
+				in += length;
+			}
+
+			dst += length;
+		}
+
+		return dst == dstEnd;
+	}
+
+}
@@ -1,8 +1,17 @@
 #include "gb/emulator.hpp"
 #include "emu/helper.hpp"
-#include "system/viewport_manager.hpp"
 #include "utils/timer.hpp"
 
+#ifdef _WIN32
+	#define NOMINMAX
+	#include <Windows.h>
+#else
+	#include <sys/mman.h>
+#endif
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <sstream>
 
@@ -26,81 +35,246 @@
 #endif
 
 #include "gb/memory_mapping.inc.hpp"
+#include "gb/mbc.inc.hpp"
 #include "gb/cpu.inc.hpp"
+#include "gb/threaded.inc.hpp"
+#include "gb/block_cache.inc.hpp"
+#include "gb/scheduler.inc.hpp"
+#include "gb/idle_loop.inc.hpp"
 #include "gb/ppu.inc.hpp"
+#include "gb/state.inc.hpp"
 
 namespace gb {
 
-	//Split rom buffer into separate banks
-	_inline_ List<emu::ProgramMemoryRange> makeBanks(const Buffer &rom, const Buffer &bios) {
+	//Describe the layout of a cartridge; the ROM and BIOS are read from their images
 
-		if (rom.size() < 0x14D)
+	_inline_ List<Memory::Range> makeBanks(const RomImage *rom, const RomImage *bios) {
+
+		if (!rom || rom->size() < 0x14D)
 			oic::System::log()->fatal("ROM requires a minimum size of 0x14D");
 
-		if (bios.size() && bios.size() != MemoryMapper::biosLength)
+		if (bios && bios->contentSize() != MemoryMapper::biosLength)
 			oic::System::log()->fatal("BIOS requires to be 256 bytes");
 
+		const u8 *header = rom->data();
 		usz x = 0;
 
 		for (usz i = 0x134; i < 0x14D; ++i)
-			x -= usz(u8(rom[i] + 1));
+			x -= usz(u8(header[i] + 1));
 
-		if (u8(x) != rom[0x14D])
+		if (u8(x) != header[0x14D])
 			oic::System::log()->fatal("ROM has an invalid checksum");
 
-		usz romBankSize = 16_KiB, romBanks = rom[0x148];
+		const usz romBanks = MemoryMapper::romBanks(header), ramBanks = MemoryMapper::ramBanks(header);
+		constexpr usz romBankSize = 16_KiB, ramBankSize = 8_KiB;
 
-		switch (romBanks) {
-			case 52: romBanks = 72;						break;
-			case 53: romBanks = 80;						break;
-			case 54: romBanks = 96;						break;
-			default: romBanks = usz(2 << romBanks);
-		}
+		if (rom->size() > romBankSize * romBanks)
+			oic::System::log()->fatal("ROM is bigger than its header says");
 
-		usz ramBankSize = 8_KiB, ramBanks = 1;
-
-		switch (rom[0x149]) {
-			case 0: ramBanks = 0;						break;
-			case 1: ramBankSize = 2_KiB;				break;
-			case 2: ramBanks = 1;						break;
-			case 3: ramBanks = 4;						break;
-			case 4: ramBanks = 16;						break;
-			case 5: ramBanks = 8;						break;
-			default:
-				oic::System::log()->fatal("RAM banks are invalid");
-		}
-
-		using Range = emu::ProgramMemoryRange;
+		using Range = Memory::Range;
 
 		auto ranges = List<Range> {
-			Range { MemoryMapper::cpuStart, MemoryMapper::cpuLength, true, "CPU", "CPU Memory", {}, false },
+			Range { MemoryMapper::cpuStart, MemoryMapper::cpuLength, true, "CPU", "CPU Memory", {} },
 			Range { MemoryMapper::ramStart, ramBankSize * ramBanks, true, "RAM #n", "RAM Banks", {} },
-			Range { MemoryMapper::romStart, romBankSize * romBanks, false, "ROM #n", "ROM Banks", rom },
-			Range { MemoryMapper::mmuStart, MemoryMapper::mmuLength, true, "MMU", "Memory Unitadditional variables", {} }
+			Range { MemoryMapper::romStart, romBankSize * romBanks, false, "ROM #n", "ROM Banks", {} },
+			Range { MemoryMapper::mmuStart, MemoryMapper::mmuLength, true, "MMU", "Memory Unitadditional variables", {} },
+			Range { MemoryMapper::controllerStart, MemoryMapper::controllerLength, true, "MBC", "Memory bank controller handlers", {} },
+			Range { MemoryMapper::codeGenStart, MemoryMapper::codeGenLength, true, "Code gen", "Write generation of code pages", {} },
+			Range { MemoryMapper::readPages, MemoryMapper::pagesLength, true, "Pages", "Page table of the cpu memory", {} }
 		};
 
-		if (bios.size())
-			ranges.push_back(Range { MemoryMapper::biosStart, MemoryMapper::biosLength, false, "BIOS", "BIOS Memory", bios });
+		if (bios)
+			ranges.push_back(Range { MemoryMapper::biosStart, MemoryMapper::biosLength, false, "BIOS", "BIOS Memory", {} });
 
 		return ranges;
 	}
 
-	Emulator::Emulator(const Buffer &rom, const Buffer &bios) : m(
-		makeBanks(rom, bios),
-		List<Memory::Range>{
-			Memory::Range { 0x0000_u16, u16(32_KiB), false, "ROM", "Readonly memory", {}, false },
-			Memory::Range { 0x8000_u16, u16(8_KiB), true, "VRAM", "Video memory", {} },
-			Memory::Range { 0xA000_u16, u16(8_KiB), true, "SAV", "Cartridge RAM", {}, false },
-			Memory::Range { 0xC000_u16, u16(8_KiB), true, "RAM", "Random access memory", {} },
-			Memory::Range { 0xE000_u16, u16(0xFE00 - 0xE000), true, "ERAM", "Echo RAM", {}, false },
-			Memory::Range { 0xFE00_u16, 512_u16, true, "I/O", "Input Output registers", {} }
-		})
+	//Every bank in the header has to be readable; ROMs that are cut short get a zero padded copy
+
+	_inline_ std::shared_ptr<const RomImage> padRom(std::shared_ptr<const RomImage> rom) {
+
+		if (!rom || rom->size() < 0x14D)
+			return rom;
+
+		const usz size = MemoryMapper::romBanks(rom->data()) * 16_KiB;
+
+		if (rom->size() >= size)
+			return rom;
+
+		Buffer padded(size);
+		std::memcpy(padded.data(), rom->data(), rom->size());
+		return RomCache::get(padded);
+	}
+
+	//Straight from the OS; pages are zeroed on first touch, so the parts of the layout that are never used
+	//(the ROM and external RAM areas of the cpu memory, missing RAM banks) don't take up memory
+	//Page aligned, so the MMU variables start a cache line
+
+	_inline_ u8 *allocateMemory(usz length) {
+
+		#ifdef _WIN32
+			void *data = VirtualAlloc(nullptr, length, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+		#else
+			void *data = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+			if (data == MAP_FAILED)
+				data = nullptr;
+		#endif
+
+		if (!data)
+			oic::System::log()->fatal("Couldn't allocate emulator memory");
+
+		return (u8*) data;
+	}
+
+	_inline_ void freeMemory(u8 *data, usz length) {
+
+		#ifdef _WIN32
+			(void) length;
+			VirtualFree(data, 0, MEM_RELEASE);
+		#else
+			munmap(data, length);
+		#endif
+	}
+
+	_inline_ usz memoryLength(const List<Memory::Range> &ranges) {
+
+		usz end = MemoryMapper::memStart + MemoryMapper::memLength;
+
+		for (const Memory::Range &range : ranges)
+			if (range.writable)
+				end = std::max(end, range.start + range.size);
+
+		return end - MemoryMapper::memStart;
+	}
+
+	Memory::Memory(const List<Range> &ranges, std::shared_ptr<const RomImage> rom, std::shared_ptr<const RomImage> bios):
+		length(memoryLength(ranges)), romImage(std::move(rom)), biosImage(std::move(bios))
 	{
-		m.getMemory<u64>(Emulator::MBC_ROM >> 8) = MemoryMapper::romStart;
-		m.getMemory<u64>(Emulator::MBC_RAM >> 8) = MemoryMapper::ramStart - 0xC000;
+		data = allocateMemory(length);
+		base = u64(data) - MemoryMapper::memStart;
+
+		romBase = u64(romImage->data()) - MemoryMapper::romStart;
+		biosBase = biosImage ? u64(biosImage->data()) - MemoryMapper::biosStart : 0;
+
+		for (const Range &range : ranges) {
+
+			if (!range.writable)
+				continue;
+
+			writable.push_back(Range { range.start, range.size, true, range.name, range.desc, {} });
 
-		if(bios.size())
+			if (range.init.size())
+				std::memcpy(data + (range.start - MemoryMapper::memStart), range.init.data(), std::min(range.init.size(), range.size));
+		}
+	}
+
+	Memory::Memory(const Memory *parent):
+		length(parent->length), writable(parent->writable),
+		romImage(parent->romImage), biosImage(parent->biosImage), romBase(parent->romBase), biosBase(parent->biosBase)
+	{
+		data = allocateMemory(length);
+		base = u64(data) - MemoryMapper::memStart;
+
+		//Zeroed memory isn't touched, so the OS can keep it unallocated (most of the cpu memory and RAM banks)
+
+		static constexpr usz chunk = 4_KiB;
+
+		for (const Range &range : writable)
+			for (usz i = 0; i < range.size; i += chunk) {
+
+				const usz offset = range.start - MemoryMapper::memStart + i, size = std::min(chunk, range.size - i);
+				const u8 *src = parent->data + offset;
+
+				if (src[0] || std::memcmp(src, src + 1, size - 1))
+					std::memcpy(data + offset, src, size);
+			}
+	}
+
+	Memory::~Memory() {
+		freeMemory(data, length);
+	}
+
+	//Buffers go through the cache as well, so instances created from the same ROM share one copy
+
+	Emulator::Emulator(const Buffer &rom, const Buffer &bios):
+		Emulator(RomCache::get(rom), RomCache::get(bios)) {}
+
+	Emulator::Emulator(std::shared_ptr<const RomImage> rom, std::shared_ptr<const RomImage> bios):
+		m(makeBanks(rom.get(), bios.get()), padRom(rom), bios)
+	{
+		if (bios)
 			setFlag<true, Emulator::IS_IN_BIOS>();
+
+		MemoryMapper::initPages(&m);
+		MemoryMapper::updateJoypad(&m);
+
+		if (MemoryMapper::initController(&m, m.rom()))
+			scheduler.schedule(EVENT_RTC, rtcPeriod);
+
+		scheduler.schedule(EVENT_PPU, ppuIntervals[m.getRef<u8>(io::stat) & 3]);
+		scheduler.schedule(EVENT_DIV, divPeriod);
+
+		if (!bios)
+			skipBios();
+	}
+
+	//State the DMG boot ROM leaves behind when it jumps to the cartridge
+	//STAT and LY are left to the PPU, which is already running
+
+	struct PostBootIo {
+		Address a;
+		u8 v;
+	};
+
+	static constexpr PostBootIo postBootIo[] = {
+
+		{ io::joypad, 0xCF },
+		{ io::transferControl, 0x7E },
+		{ io::div, 0xAB },
+		{ io::tac, 0xF8 },
+		{ io::IF, 0xE1 },
+
+		{ io::sweep1, 0x80 }, { io::length1, 0xBF }, { io::volume1, 0xF3 }, { io::freqHi1, 0xBF },
+		{ io::length2, 0x3F }, { io::freqHi2, 0xBF },
+		{ io::off3, 0x7F }, { io::length3, 0xFF }, { io::outLvl3, 0x9F }, { io::freqHi3, 0xBF },
+		{ io::length4, 0xFF }, { io::counter4, 0xBF },
+		{ io::channelControl, 0x77 }, { io::soundOutputTerminal, 0xF3 }, { io::enableSound, 0xF1 },
+
+		{ io::ctrl, 0x91 },
+		{ io::bgp, 0xFC }, { io::obp0, 0xFF }, { io::obgp1, 0xFF }
+	};
+
+	void Emulator::skipBios() {
+
+		for (const PostBootIo &io : postBootIo)
+			m.getRef<u8>(io.a) = io.v;
+
+		MemoryMapper::updateJoypad(&m);
+		MemoryMapper::unmapBios(&m);
+
+		//The flags depend on the header checksum
+
+		af = m.rom()[0x14D] ? 0x01B0 : 0x0180;
+		bc = 0x0013;
+		de = 0x00D8;
+		hl = 0x014D;
+		sp = 0xFFFE;
+		pc = 0x0100;
+	}
+
+	//The page table has host offsets, so it's rebuilt for the memory of the child
+
+	Emulator::Emulator(const Emulator *parent):
+		m(&parent->m), cpuMode(parent->cpuMode), render(parent->render), renderEvery(parent->renderEvery), lastTime(parent->lastTime), frames(parent->frames),
+		cycle(parent->cycle), divBase(parent->divBase), scheduler(parent->scheduler)
+	{
+		std::memcpy(lregs, parent->lregs, sizeof(lregs));
+		MemoryMapper::remap(&m);
+	}
+
+	std::unique_ptr<Emulator> Emulator::fork() const {
+		return std::unique_ptr<Emulator>(new Emulator(this));
 	}
 
 	//CPU/GPU emulation
@@ -108,15 +282,21 @@ namespace gb {
 	template<bool doSync>
 	void Emulator::internalFrame(const oic::Grid2D<u32> &buffer) {
 
-		if (buffer.size()[0] == specs::height && buffer.size()[1] == specs::width)
-			output = buffer;
+		bool pushScreen{};
 
-		if (!output.linearSize())
-			output = oic::Grid2D<u32>(Vec2usz(specs::height, specs::width));
+		const bool draw = rendersFrame();
+		++frames;
 
-		bool pushScreen{};
+		//Frame buffers are drawn into as they are; the grid passed in is only used without them
 
-		pushBlank<false>(output.begin(), output.end());
+		const bool ring = !frameRing.empty();
+
+		if (!ring && outputFormat == OUTPUT_RGBA && buffer.size()[0] == specs::height && buffer.size()[1] == specs::width)
+			output = buffer;
+
+		u8 *out = ring ? nullptr : outputTarget();
+
+		target = !draw ? nullptr : (ring ? (u8*) frameRing.begin() : out);
 
 		if constexpr (doSync) {
 
@@ -135,11 +315,17 @@ namespace gb {
 		#endif
 
 		while (!pushScreen) {
-			ppuCycle += cpuStep();
-			ppuCycle += interruptHandler();
-			ppuStep(pushScreen, output.begin());
+			cycle += cpuRun(usz(scheduler.next - cycle));
+			runEvents(pushScreen);
 		}
 
+		//The PPU already finished the target at vblank
+
+		if (target && ring)
+			frameRing.finish(target, changed);
+
+		target = nullptr;
+
 		if constexpr (doSync)
 			lastTime = oic::Timer::now();
 	}
@@ -152,14 +338,126 @@ namespace gb {
 		internalFrame<true>(buffer);
 	}
 
-	void Emulator::step(bool &pushScreen) {
+	//Frames end at vblank here as well; the next one is drawn or skipped like it would be by frame
+
+	void Emulator::run(u64 cycles) {
+
+		u8 *out = outputTarget();
+		target = rendersFrame() ? out : nullptr;
+
+		const u64 end = cycle + cycles;
+		bool pushScreen{};
+
+		while (cycle < end) {
+
+			cycle += cpuRun(usz(std::min(scheduler.next, end) - cycle));
+			runEvents(pushScreen);
+
+			if (pushScreen) {
+				pushScreen = false;
+				++frames;
+				target = rendersFrame() ? out : nullptr;
+			}
+		}
+
+		target = nullptr;
+	}
+
+	//Output
+
+	void Emulator::setOutput(OutputFormat format, u8 *shades) {
+		outputFormat = format;
+		shadeOutput = format == OUTPUT_RGBA ? nullptr : shades;
+		allLinesChanged = true;
+	}
+
+	//Where frames go without frame buffers; allocates output for RGBA
+
+	u8 *Emulator::outputTarget() {
+
+		if (outputFormat != OUTPUT_RGBA)
+			return shadeOutput;
 
 		if (!output.linearSize())
 			output = oic::Grid2D<u32>(Vec2usz(specs::height, specs::width));
 
-		ppuCycle += cpuStep();
-		ppuCycle += interruptHandler();
-		ppuStep(pushScreen, output.begin());
+		return (u8*) output.begin();
+	}
+
+	void Emulator::setFrameBuffers(void *const *buffers, usz count) {
+		frameRing.set(buffers, count);
+		allLinesChanged = true;
+	}
+
+	void *Emulator::acquireFrame(LineMask *changedLines) {
+		return frameRing.acquire(changedLines);
+	}
+
+	void Emulator::releaseFrame(void *buffer) {
+		frameRing.release(buffer);
+	}
+
+	usz Emulator::outputSize(OutputFormat format) {
+
+		static constexpr usz count = specs::width * specs::height;
+
+		switch (format) {
+			case OUTPUT_SHADES:			return count;
+			case OUTPUT_PACKED_SHADES:	return count / 4;
+			default:					return count * sizeof(u32);
+		}
+	}
+
+	void Emulator::expandShades(OutputFormat format, const u8 *shades, u32 *rgba) {
+
+		static constexpr usz width = specs::width;
+
+		if (format == OUTPUT_SHADES) {
+			pixels::best().colorize(shades, width * specs::height, palette, rgba);
+			return;
+		}
+
+		if (format != OUTPUT_PACKED_SHADES)
+			return;
+
+		u8 line[width];
+
+		for (usz y = 0; y < specs::height; ++y, shades += width / 4, rgba += width) {
+
+			for (usz i = 0; i < width; ++i)
+				line[i] = (shades[i >> 2] >> ((i & 3) * 2)) & 3;
+
+			pixels::best().colorize(line, width, palette, rgba);
+		}
+	}
+
+	void Emulator::setButtons(u8 pressed) {
+
+		const u8 before = m.getRef<u8>(io::joypad);
+
+		m.getMemory<u8>(Emulator::BUTTONS >> 8) = pressed;
+		MemoryMapper::updateJoypad(&m);
+
+		if (before & ~m.getRef<u8>(io::joypad) & 0xF)
+			requestInterrupt(0x10);
+	}
+
+	void Emulator::step(bool &pushScreen) {
+
+		u8 *out = outputTarget();
+		target = rendersFrame() ? out : nullptr;
+
+		bool vblank{};
+
+		cycle += getFlag<Emulator::IS_HALTED>() ? usz(scheduler.next - cycle) : cpuStep();
+		runEvents(vblank);
+
+		if (vblank) {
+			pushScreen = true;
+			++frames;
+		}
+
+		target = nullptr;
 	}
 
 }
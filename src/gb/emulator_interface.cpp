@@ -1,6 +1,7 @@
 #include "system/system.hpp"
 #include "system/log.hpp"
 #include "system/local_file_system.hpp"
+#include "input/keyboard.hpp"
 #include "gb/emulator_interface.hpp"
 using namespace gb;
 
@@ -11,6 +12,12 @@ EmulatorInterface::EmulatorInterface(Graphics &g, const Buffer &buf, const Buffe
 		Texture::Info(gbRes, GPUFormat::RGBA8, GPUMemoryUsage::CPU_WRITE, 1, 1)
 	};
 
+	//The emulator draws straight into the texture data, it's flushed once a frame is done
+	//One buffer is enough; update acquires each frame right after it's drawn, on the same thread
+
+	void *frameData = emulationData->getTextureData2D<u32>().begin();
+	em.setFrameBuffers(&frameData, 1);
+
 	Buffer vertShader, fragShader;
 
 	oicAssert("Couldn't find vertex shader", System::files()->read("./shaders/full_screen.vert.spv", vertShader));
@@ -88,10 +95,46 @@ void EmulatorInterface::render(const ViewportInfo*) {
 }
 
 void EmulatorInterface::update(const ViewportInfo*, f64) {
-	em.frame(emulationData->getTextureData2D<u32>());
-	emulationData->flush({ Vec2u8(0, 1) });
+	em.frame({});
+
+	//Static screens (menus, idle) draw the same frame over and over, those don't have to be uploaded again
+
+	LineMask changed;
+
+	if (void *frame = em.acquireFrame(&changed)) {
+
+		if (changed.any())
+			emulationData->flush({ Vec2u8(0, 1) });
+
+		em.releaseFrame(frame);
+	}
 }
 
-void EmulatorInterface::onInputUpdate(ViewportInfo*, const InputDevice*, InputHandle, bool) {
+//Arrows for the d-pad, X/Z for A/B, enter for start and backspace for select
+
+void EmulatorInterface::onInputUpdate(ViewportInfo*, const InputDevice *dvc, InputHandle ih, bool isActive) {
+
+	if (!dvc->isType(InputDevice::KEYBOARD))
+		return;
+
+	u8 button{};
+
+	switch (ih) {
+
+		case Key::Key_right:		button = Emulator::BUTTON_RIGHT;	break;
+		case Key::Key_left:			button = Emulator::BUTTON_LEFT;		break;
+		case Key::Key_up:			button = Emulator::BUTTON_UP;		break;
+		case Key::Key_down:			button = Emulator::BUTTON_DOWN;		break;
+
+		case Key::Key_x:			button = Emulator::BUTTON_A;		break;
+		case Key::Key_z:			button = Emulator::BUTTON_B;		break;
+		case Key::Key_backspace:	button = Emulator::BUTTON_SELECT;	break;
+		case Key::Key_enter:		button = Emulator::BUTTON_START;	break;
+
+		default:
+			return;
+	}
 
+	buttons = u8(isActive ? buttons | button : buttons & ~button);
+	em.setButtons(buttons);
 }
\ No newline at end of file
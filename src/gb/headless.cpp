@@ -0,0 +1,341 @@
+#include "gb/batch.hpp"
+#include "gb/movie.hpp"
+#include "gb/pixels.hpp"
+#include "utils/timer.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <string>
+using namespace gb;
+
+//Runs a ROM without a window or GPU; for batch servers and benchmarks
+
+static void usage() {
+	std::fprintf(stderr,
+		"Usage: gb-headless <rom> [options]\n"
+		"       gb-headless --bench-pixels    Compare the pixel kernels against the scalar one\n"
+		"  --bios <file>         Boot ROM to run before the cartridge\n"
+		"  --frames <n>          Frames to run (default 3600)\n"
+		"  --cycles <n>          Run until n machine cycles have passed instead (ends on a frame)\n"
+		"  --mode <mode>         interpreter or block (default interpreter)\n"
+		"  --dump <prefix>       Write frames to <prefix><frame>.ppm\n"
+		"  --dump-every <n>      Only dump every nth frame (default 1)\n"
+		"  --render-every <n>    Only render every nth frame, 0 for none (default 1); the rest run without pixel work\n"
+		"  --output <format>     rgba, shades or packed (default rgba); dumps are expanded to RGB\n"
+		"  --instances <n>       Run n copies of the ROM at once (no frame dumps)\n"
+		"  --threads <n>         Worker threads for the instances (default: all cores)\n"
+		"  --pin                 Pin every worker thread to its own core\n"
+		"  --movie <file>        Replay the input of a movie (--frames defaults to its length)\n"
+		"  --start <n>           Seek to frame n of the movie first\n"
+	);
+}
+
+static bool readFile(const char *path, Buffer &buffer) {
+
+	std::ifstream file(path, std::ios::binary | std::ios::ate);
+
+	if (!file)
+		return false;
+
+	buffer.resize(usz(file.tellg()));
+	file.seekg(0);
+
+	return bool(file.read((char*)buffer.data(), std::streamsize(buffer.size())));
+}
+
+//Binary PPM, so frames can be viewed or diffed without any dependencies
+
+static bool dumpFrame(const std::string &path, const u32 *it) {
+
+	std::ofstream file(path, std::ios::binary);
+
+	if (!file)
+		return false;
+
+	file << "P6\n" << usz(specs::width) << " " << usz(specs::height) << "\n255\n";
+
+	for (usz i = 0, j = specs::width * specs::height; i < j; ++i) {
+		const char rgb[3] = { char(it[i]), char(it[i] >> 8), char(it[i] >> 16) };
+		file.write(rgb, 3);
+	}
+
+	return bool(file);
+}
+
+//Every pixel kernel the CPU supports against the scalar one; a full tile set and a frame of lines
+
+static int benchPixels() {
+
+	using namespace pixels;
+
+	constexpr usz rows = 384 * 8, pixelCount = usz(specs::width) * specs::height, runs = 2000;
+
+	Buffer tiles(rows * 2);
+	u32 seed = 1;
+
+	for (u8 &b : tiles)
+		b = u8((seed = seed * 1664525 + 1013904223) >> 24);
+
+	static constexpr u32 shades[4] = { 0xE0F8D0, 0x88C070, 0x346856, 0x081820 };
+
+	const Kernels &scalar = *get(SCALAR);
+
+	Buffer reference(rows * 8), decoded(rows * 8);
+	List<u32> colors(pixelCount), referenceColors(pixelCount);
+
+	scalar.decode(tiles.data(), rows, reference.data());
+	scalar.colorize(reference.data(), pixelCount, shades, referenceColors.data());
+
+	std::printf("%-8s %14s %14s\n", "kernel", "decode Mpx/s", "color Mpx/s");
+
+	for (usz i = 0; i < ISA_COUNT; ++i) {
+
+		const Kernels *k = get(Isa(i));
+
+		if (!k)
+			continue;
+
+		ns start = oic::Timer::now();
+
+		for (usz r = 0; r < runs; ++r)
+			k->decode(tiles.data(), rows, decoded.data());
+
+		const f64 decodeTime = f64(oic::Timer::now() - start) / 1e9;
+
+		start = oic::Timer::now();
+
+		for (usz r = 0; r < runs; ++r)
+			k->colorize(decoded.data(), pixelCount, shades, colors.data());
+
+		const f64 colorTime = f64(oic::Timer::now() - start) / 1e9;
+
+		const bool matches = decoded == reference && colors == referenceColors;
+
+		std::printf(
+			"%-8s %14.1f %14.1f%s%s\n", k->name,
+			f64(rows * 8 * runs) / 1e6 / decodeTime, f64(pixelCount * runs) / 1e6 / colorTime,
+			matches ? "" : "  MISMATCH", k == &best() ? "  (used)" : ""
+		);
+
+		if (!matches)
+			return 1;
+	}
+
+	return 0;
+}
+
+int main(int argc, char **argv) {
+
+	if (argc < 2) {
+		usage();
+		return 1;
+	}
+
+	if (!std::strcmp(argv[1], "--bench-pixels"))
+		return benchPixels();
+
+	const char *romPath = argv[1], *biosPath{}, *dumpPrefix{}, *moviePath{};
+	u64 frames{}, cycles{}, dumpEvery = 1, instances = 1, startFrame{};
+	Emulator::OutputFormat outputFormat = Emulator::OUTPUT_RGBA;
+	Batch::Info batch;
+
+	for (int i = 2; i < argc; ++i) {
+
+		const char *arg = argv[i], *val = i + 1 < argc ? argv[i + 1] : nullptr;
+
+		if (!std::strcmp(arg, "--pin")) {
+			batch.pinThreads = true;
+			continue;
+		}
+
+		if (!val) {
+			usage();
+			return 1;
+		}
+
+		if (!std::strcmp(arg, "--bios"))				biosPath = val;
+		else if (!std::strcmp(arg, "--frames"))			frames = std::strtoull(val, nullptr, 10);
+		else if (!std::strcmp(arg, "--cycles"))			cycles = std::strtoull(val, nullptr, 10);
+		else if (!std::strcmp(arg, "--dump"))			dumpPrefix = val;
+		else if (!std::strcmp(arg, "--dump-every"))		dumpEvery = std::strtoull(val, nullptr, 10);
+		else if (!std::strcmp(arg, "--render-every"))	batch.renderEvery = u32(std::strtoul(val, nullptr, 10));
+		else if (!std::strcmp(arg, "--instances"))		instances = std::strtoull(val, nullptr, 10);
+		else if (!std::strcmp(arg, "--threads"))		batch.threads = usz(std::strtoull(val, nullptr, 10));
+		else if (!std::strcmp(arg, "--movie"))			moviePath = val;
+		else if (!std::strcmp(arg, "--start"))			startFrame = std::strtoull(val, nullptr, 10);
+
+		else if (!std::strcmp(arg, "--output")) {
+
+			if (!std::strcmp(val, "rgba"))				outputFormat = Emulator::OUTPUT_RGBA;
+			else if (!std::strcmp(val, "shades"))		outputFormat = Emulator::OUTPUT_SHADES;
+			else if (!std::strcmp(val, "packed"))		outputFormat = Emulator::OUTPUT_PACKED_SHADES;
+
+			else {
+				usage();
+				return 1;
+			}
+		}
+
+		else if (!std::strcmp(arg, "--mode")) {
+
+			if (!std::strcmp(val, "interpreter"))		batch.cpuMode = Emulator::INTERPRETER;
+			else if (!std::strcmp(val, "block"))		batch.cpuMode = Emulator::BLOCK_CACHE;
+
+			else {
+				usage();
+				return 1;
+			}
+		}
+
+		else {
+			usage();
+			return 1;
+		}
+
+		++i;
+	}
+
+	if (!dumpEvery)
+		dumpEvery = 1;
+
+	//Mapped, not read; every instance below runs from the same pages
+
+	const std::shared_ptr<const RomImage> rom = RomCache::open(romPath);
+	std::shared_ptr<const RomImage> bios;
+
+	if (!rom) {
+		std::fprintf(stderr, "Couldn't read ROM \"%s\"\n", romPath);
+		return 1;
+	}
+
+	if (biosPath && !(bios = RomCache::open(biosPath))) {
+		std::fprintf(stderr, "Couldn't read BIOS \"%s\"\n", biosPath);
+		return 1;
+	}
+
+	Buffer movieData;
+
+	if (moviePath && !readFile(moviePath, movieData)) {
+		std::fprintf(stderr, "Couldn't read movie \"%s\"\n", moviePath);
+		return 1;
+	}
+
+	if (moviePath && instances > 1) {
+		std::fprintf(stderr, "Movies can only be replayed on a single instance\n");
+		return 1;
+	}
+
+	if (!frames && !moviePath)
+		frames = 3600;
+
+	//Many instances; throughput over all of them
+
+	if (instances > 1) {
+
+		Batch runner(batch);
+
+		for (u64 i = 0; i < instances; ++i)
+			runner.add(rom, bios);
+
+		const ns start = oic::Timer::now();
+
+		if (cycles) runner.runCycles(cycles);
+		else runner.runFrames(frames);
+
+		const f64 seconds = f64(oic::Timer::now() - start) / 1e9;
+
+		u64 totalCycles{};
+
+		for (usz i = 0; i < runner.size(); ++i)
+			totalCycles += runner[i]->cycle;
+
+		std::printf(
+			"%llu instances on %llu threads, %llu cycles in %.3f s; %.2f MHz (%.1fx real time)\n",
+			(unsigned long long) instances, (unsigned long long) runner.threads(), (unsigned long long) totalCycles,
+			seconds, f64(totalCycles) / 1e6 / seconds, f64(totalCycles) / 1'048'576 / seconds
+		);
+
+		return 0;
+	}
+
+	Emulator emu(rom, bios);
+	emu.cpuMode = batch.cpuMode;
+	emu.renderEvery = batch.renderEvery;
+
+	//The movie is checked against the emulator's states, so it's only parsed once there is one
+
+	Movie movie;
+
+	if (moviePath && !movie.read(movieData, emu)) {
+		std::fprintf(stderr, "Movie \"%s\" is damaged or wasn't recorded with this emulator\n", moviePath);
+		return 1;
+	}
+
+	if (moviePath && !frames)
+		frames = movie.frames() > startFrame ? movie.frames() - startFrame : 0;
+
+	if (moviePath && !movie.seek(emu, startFrame)) {
+		std::fprintf(stderr, "Movie doesn't belong to this ROM or is shorter than %llu frames\n", (unsigned long long) startFrame);
+		return 1;
+	}
+
+	//Frames are drawn into two buffers of our own and written from there, without copies
+
+	List<u32> frameData[2], rgba(specs::width * specs::height);
+	void *frameBuffers[2];
+
+	for (usz i = 0; i < 2; ++i) {
+		frameData[i].resize((Emulator::outputSize(outputFormat) + 3) / 4);
+		frameBuffers[i] = frameData[i].data();
+	}
+
+	emu.setOutput(outputFormat);
+	emu.setFrameBuffers(frameBuffers, 2);
+
+	const ns start = oic::Timer::now();
+	u64 frame{};
+
+	while (cycles ? emu.cycle < cycles : frame < frames) {
+
+		if (moviePath && startFrame + frame < movie.frames())
+			emu.setButtons(movie.input(startFrame + frame));
+
+		emu.frameNoSync({});
+
+		if (void *data = emu.acquireFrame()) {
+
+			if (dumpPrefix && frame % dumpEvery == 0) {
+
+				const u32 *pixels = (const u32*) data;
+
+				if (outputFormat != Emulator::OUTPUT_RGBA) {
+					Emulator::expandShades(outputFormat, (const u8*) data, rgba.data());
+					pixels = rgba.data();
+				}
+
+				if (!dumpFrame(dumpPrefix + std::to_string(frame) + ".ppm", pixels)) {
+					std::fprintf(stderr, "Couldn't write frame %llu\n", (unsigned long long) frame);
+					return 1;
+				}
+			}
+
+			emu.releaseFrame(data);
+		}
+
+		++frame;
+	}
+
+	//Throughput; the Gameboy runs at 1.048576 MHz machine cycles
+
+	const f64 seconds = f64(oic::Timer::now() - start) / 1e9;
+	const f64 speed = f64(emu.cycle) / 1'048'576 / seconds;
+
+	std::printf(
+		"%llu frames, %llu cycles in %.3f s; %.1f fps, %.2f MHz (%.1fx real time)\n",
+		(unsigned long long) frame, (unsigned long long) emu.cycle, seconds,
+		f64(frame) / seconds, f64(emu.cycle) / 1e6 / seconds, speed
+	);
+
+	return 0;
+}
@@ -0,0 +1,206 @@
+#include "gb/movie.hpp"
+#include "gb/delta.hpp"
+#include "system/system.hpp"
+#include "system/log.hpp"
+#include <algorithm>
+#include <cstring>
+
+namespace gb {
+
+	static _inline_ u16 romChecksumOf(Emulator &e) {
+		const u8 *rom = e.m.rom();
+		return u16(rom[0x14E] << 8 | rom[0x14F]);
+	}
+
+	static _inline_ u8 headerChecksumOf(Emulator &e) {
+		return e.m.rom()[0x14D];
+	}
+
+	Movie::Movie(usz interval): keyframeInterval(interval) {
+		if (!keyframeInterval)
+			oic::System::log()->fatal("Movie requires a keyframe interval");
+	}
+
+	bool Movie::matches(Emulator &e) const {
+		return romChecksum == romChecksumOf(e) && headerChecksum == headerChecksumOf(e) && stateSize == e.stateSize();
+	}
+
+	//Recording
+
+	void Movie::record(Emulator &e, u8 buttons) {
+
+		if (inputs.empty()) {
+
+			romChecksum = romChecksumOf(e);
+			headerChecksum = headerChecksumOf(e);
+			stateSize = e.stateSize();
+
+			state.resize(stateSize);
+			scratch.resize(delta::bound(stateSize));
+		}
+
+		if (inputs.size() % keyframeInterval == 0) {
+
+			e.saveState(state.data(), state.size());
+
+			const usz size = delta::compress(state.data(), nullptr, state.size(), scratch.data());
+
+			keyframes.push_back(Keyframe{ states.size(), size });
+			states.insert(states.end(), scratch.begin(), scratch.begin() + size);
+		}
+
+		inputs.push_back(buttons);
+		e.setButtons(buttons);
+	}
+
+	//Replay
+
+	bool Movie::seek(Emulator &e, u64 frame) {
+
+		if (frame > frames() || !matches(e))
+			return false;
+
+		if (keyframes.empty())
+			return false;
+
+		const usz k = usz(std::min(frame / keyframeInterval, u64(keyframes.size() - 1)));
+
+		std::memset(state.data(), 0, state.size());
+
+		if (
+			!delta::apply(states.data() + keyframes[k].offset, keyframes[k].size, state.data(), state.size()) ||
+			!e.loadState(state.data(), state.size())
+		)
+			return false;
+
+		//Nobody sees the frames in between, so they aren't rendered
+
+		const bool render = e.render;
+		e.render = false;
+
+		for (u64 i = u64(k) * keyframeInterval; i < frame; ++i) {
+			e.setButtons(inputs[i]);
+			e.frameNoSync({});
+		}
+
+		e.render = render;
+		return true;
+	}
+
+	u64 Movie::play(Emulator &e, u64 from, u64 count, const oic::Grid2D<u32> &buffer) {
+
+		if (!seek(e, from))
+			return 0;
+
+		const u64 end = from + std::min(count, frames() - from);
+
+		for (u64 i = from; i < end; ++i) {
+			e.setButtons(inputs[i]);
+			e.frameNoSync(buffer);
+		}
+
+		return end - from;
+	}
+
+	//Serialization
+	//Header, the input of every frame, then every keyframe as (u64 size, compressed state)
+	//When read, the states are kept as they are in the file; the offsets skip the sizes
+
+	void Movie::write(Buffer &out) const {
+
+		const Header header {
+			magic, version, romChecksum, headerChecksum, {}, u32(keyframeInterval),
+			inputs.size(), keyframes.size(), stateSize
+		};
+
+		usz size = sizeof(header) + inputs.size();
+
+		for (const Keyframe &keyframe : keyframes)
+			size += sizeof(u64) + keyframe.size;
+
+		out.resize(size);
+
+		u8 *it = out.data();
+
+		auto put = [&it](const void *src, usz length) {
+			std::memcpy(it, src, length);
+			it += length;
+		};
+
+		put(&header, sizeof(header));
+		put(inputs.data(), inputs.size());
+
+		for (const Keyframe &keyframe : keyframes) {
+			const u64 size = keyframe.size;
+			put(&size, sizeof(size));
+			put(states.data() + keyframe.offset, keyframe.size);
+		}
+	}
+
+	bool Movie::read(const Buffer &in, Emulator &e) {
+
+		Header header;
+
+		if (in.size() < sizeof(header))
+			return false;
+
+		std::memcpy(&header, in.data(), sizeof(header));
+
+		if (
+			header.id != magic || header.ver != version || !header.keyframeInterval ||
+			header.keyframes != (header.frames + header.keyframeInterval - 1) / header.keyframeInterval ||
+			in.size() - sizeof(header) < header.frames || header.stateSize != e.stateSize()
+		)
+			return false;
+
+		const u8 *it = in.data() + sizeof(header), *end = in.data() + in.size();
+
+		List<Keyframe> keys;
+		keys.reserve(usz(header.keyframes));
+
+		const u8 *frameData = it;
+		it += header.frames;
+
+		const u8 *stateData = it;
+
+		//Every keyframe is decoded once, so seek never sees data that doesn't fit a state
+
+		Buffer decoded(usz(header.stateSize));
+
+		for (u64 i = 0; i < header.keyframes; ++i) {
+
+			u64 size;
+
+			if (usz(end - it) < sizeof(size))
+				return false;
+
+			std::memcpy(&size, it, sizeof(size));
+			it += sizeof(size);
+
+			if (usz(end - it) < size)
+				return false;
+
+			std::memset(decoded.data(), 0, decoded.size());
+
+			if (!delta::apply(it, usz(size), decoded.data(), decoded.size()))
+				return false;
+
+			keys.push_back(Keyframe{ usz(it - stateData), usz(size) });
+			it += size;
+		}
+
+		keyframeInterval = header.keyframeInterval;
+		romChecksum = header.romChecksum;
+		headerChecksum = header.headerChecksum;
+		stateSize = usz(header.stateSize);
+
+		inputs.assign(frameData, frameData + header.frames);
+		keyframes = std::move(keys);
+		states.assign(stateData, it);
+
+		state = std::move(decoded);
+		scratch.resize(delta::bound(stateSize));
+		return true;
+	}
+
+}
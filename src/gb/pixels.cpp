@@ -0,0 +1,300 @@
+#include "gb/pixels.hpp"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+	#define GB_PIXELS_X86
+#endif
+
+#ifdef GB_PIXELS_X86
+
+	#include <immintrin.h>
+
+	#ifdef _MSC_VER
+		#include <intrin.h>
+		#define GB_TARGET(isa)
+	#else
+		#define GB_TARGET(isa) __attribute__((target(isa)))
+	#endif
+
+#endif
+
+namespace gb::pixels {
+
+	//Reference
+
+	static void decodeScalar(const u8 *rows, usz count, u8 *out) {
+
+		for (usz i = 0; i < count; ++i, rows += 2, out += 8) {
+
+			const u8 lo = rows[0], hi = rows[1];
+
+			for (usz x = 0; x < 8; ++x)
+				out[x] = u8(((lo >> (7 - x)) & 1) | (((hi >> (7 - x)) & 1) << 1));
+		}
+	}
+
+	static void colorizeScalar(const u8 *indices, usz count, const u32 palette[4], u32 *out) {
+		for (usz i = 0; i < count; ++i)
+			out[i] = palette[indices[i]];
+	}
+
+	#ifdef GB_PIXELS_X86
+
+		//Every byte of a row is spread over the 8 pixels, then each pixel tests its own bit (bit 7 is the leftmost pixel)
+
+		#define GB_ROW8(i) i, i, i, i, i, i, i, i
+		#define GB_BITS8 0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01
+
+		alignas(64) static constexpr u8 pixelBits[64] = {
+			GB_BITS8, GB_BITS8, GB_BITS8, GB_BITS8, GB_BITS8, GB_BITS8, GB_BITS8, GB_BITS8
+		};
+
+		//Source byte per pixel for 4 rows (AVX2; both lanes have the same 8 rows) or 8 rows (AVX-512; all 4 lanes do)
+
+		alignas(32) static constexpr u8 avx2Spread[2][32] = {
+			{ GB_ROW8(0), GB_ROW8(2), GB_ROW8(4), GB_ROW8(6) },
+			{ GB_ROW8(8), GB_ROW8(10), GB_ROW8(12), GB_ROW8(14) }
+		};
+
+		alignas(64) static constexpr u8 avx512Spread[64] = {
+			GB_ROW8(0), GB_ROW8(2), GB_ROW8(4), GB_ROW8(6), GB_ROW8(8), GB_ROW8(10), GB_ROW8(12), GB_ROW8(14)
+		};
+
+		#undef GB_ROW8
+		#undef GB_BITS8
+
+		//SSE2; no byte shuffle, so the bytes are spread by unpacking them with themselves
+
+		GB_TARGET("sse2")
+		static inline __m128i combineSse2(__m128i lo, __m128i hi, __m128i bits) {
+
+			const __m128i l = _mm_cmpeq_epi8(_mm_and_si128(lo, bits), bits);
+			const __m128i h = _mm_cmpeq_epi8(_mm_and_si128(hi, bits), bits);
+
+			return _mm_or_si128(_mm_and_si128(l, _mm_set1_epi8(1)), _mm_and_si128(h, _mm_set1_epi8(2)));
+		}
+
+		GB_TARGET("sse2")
+		static void decodeSse2(const u8 *rows, usz count, u8 *out) {
+
+			const __m128i bits = _mm_load_si128((const __m128i*) pixelBits);
+			const __m128i lowByte = _mm_set1_epi16(0xFF);
+
+			for (usz i = 0; i < count; i += 8, rows += 16, out += 64) {
+
+				const __m128i v = _mm_loadu_si128((const __m128i*) rows);
+
+				//8 low and high bytes, then each of them 2x, 4x and 8x
+
+				const __m128i lo1 = _mm_packus_epi16(_mm_and_si128(v, lowByte), _mm_setzero_si128());
+				const __m128i hi1 = _mm_packus_epi16(_mm_srli_epi16(v, 8), _mm_setzero_si128());
+
+				const __m128i lo2 = _mm_unpacklo_epi8(lo1, lo1), hi2 = _mm_unpacklo_epi8(hi1, hi1);
+
+				const __m128i lo4[2] = { _mm_unpacklo_epi16(lo2, lo2), _mm_unpackhi_epi16(lo2, lo2) };
+				const __m128i hi4[2] = { _mm_unpacklo_epi16(hi2, hi2), _mm_unpackhi_epi16(hi2, hi2) };
+
+				for (usz j = 0; j < 2; ++j) {
+
+					const __m128i a = combineSse2(_mm_unpacklo_epi32(lo4[j], lo4[j]), _mm_unpacklo_epi32(hi4[j], hi4[j]), bits);
+					const __m128i b = combineSse2(_mm_unpackhi_epi32(lo4[j], lo4[j]), _mm_unpackhi_epi32(hi4[j], hi4[j]), bits);
+
+					_mm_storeu_si128((__m128i*)(out + j * 32), a);
+					_mm_storeu_si128((__m128i*)(out + j * 32 + 16), b);
+				}
+			}
+		}
+
+		//No variable 32-bit permute; each bit of the index selects between two colors instead
+
+		GB_TARGET("sse2")
+		static inline __m128i selectSse2(__m128i d, __m128i p0, __m128i p01, __m128i p2, __m128i p23) {
+
+			const __m128i bit0 = _mm_srai_epi32(_mm_slli_epi32(d, 31), 31);
+			const __m128i bit1 = _mm_srai_epi32(_mm_slli_epi32(d, 30), 31);
+
+			const __m128i lo = _mm_xor_si128(p0, _mm_and_si128(bit0, p01));
+			const __m128i hi = _mm_xor_si128(p2, _mm_and_si128(bit0, p23));
+
+			return _mm_xor_si128(lo, _mm_and_si128(bit1, _mm_xor_si128(lo, hi)));
+		}
+
+		GB_TARGET("sse2")
+		static void colorizeSse2(const u8 *indices, usz count, const u32 palette[4], u32 *out) {
+
+			const __m128i p0 = _mm_set1_epi32(i32(palette[0])), p2 = _mm_set1_epi32(i32(palette[2]));
+			const __m128i p01 = _mm_xor_si128(p0, _mm_set1_epi32(i32(palette[1])));
+			const __m128i p23 = _mm_xor_si128(p2, _mm_set1_epi32(i32(palette[3])));
+
+			const __m128i zero = _mm_setzero_si128();
+
+			for (usz i = 0; i < count; i += 16, out += 16) {
+
+				const __m128i v = _mm_loadu_si128((const __m128i*)(indices + i));
+				const __m128i w0 = _mm_unpacklo_epi8(v, zero), w1 = _mm_unpackhi_epi8(v, zero);
+
+				_mm_storeu_si128((__m128i*)(out + 0),  selectSse2(_mm_unpacklo_epi16(w0, zero), p0, p01, p2, p23));
+				_mm_storeu_si128((__m128i*)(out + 4),  selectSse2(_mm_unpackhi_epi16(w0, zero), p0, p01, p2, p23));
+				_mm_storeu_si128((__m128i*)(out + 8),  selectSse2(_mm_unpacklo_epi16(w1, zero), p0, p01, p2, p23));
+				_mm_storeu_si128((__m128i*)(out + 12), selectSse2(_mm_unpackhi_epi16(w1, zero), p0, p01, p2, p23));
+			}
+		}
+
+		//AVX2
+
+		GB_TARGET("avx2")
+		static void decodeAvx2(const u8 *rows, usz count, u8 *out) {
+
+			const __m256i bits = _mm256_load_si256((const __m256i*) pixelBits);
+			const __m256i one = _mm256_set1_epi8(1), two = _mm256_set1_epi8(2);
+
+			__m256i spreadLo[2], spreadHi[2];
+
+			for (usz k = 0; k < 2; ++k) {
+				spreadLo[k] = _mm256_load_si256((const __m256i*) avx2Spread[k]);
+				spreadHi[k] = _mm256_add_epi8(spreadLo[k], one);
+			}
+
+			for (usz i = 0; i < count; i += 8, rows += 16, out += 64) {
+
+				const __m256i v = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*) rows));
+
+				for (usz k = 0; k < 2; ++k) {
+
+					const __m256i lo = _mm256_shuffle_epi8(v, spreadLo[k]), hi = _mm256_shuffle_epi8(v, spreadHi[k]);
+
+					const __m256i l = _mm256_cmpeq_epi8(_mm256_and_si256(lo, bits), bits);
+					const __m256i h = _mm256_cmpeq_epi8(_mm256_and_si256(hi, bits), bits);
+
+					_mm256_storeu_si256(
+						(__m256i*)(out + k * 32),
+						_mm256_or_si256(_mm256_and_si256(l, one), _mm256_and_si256(h, two))
+					);
+				}
+			}
+		}
+
+		GB_TARGET("avx2")
+		static void colorizeAvx2(const u8 *indices, usz count, const u32 palette[4], u32 *out) {
+
+			const __m256i colors = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*) palette));
+
+			for (usz i = 0; i < count; i += 8) {
+				const __m256i d = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(indices + i)));
+				_mm256_storeu_si256((__m256i*)(out + i), _mm256_permutevar8x32_epi32(colors, d));
+			}
+		}
+
+		//AVX-512; a row per 8 byte lane and the bit tests go straight to mask registers
+		//The zero masked forms are used where GCC would warn about the undefined source of the unmasked ones
+
+		GB_TARGET("avx512f,avx512bw")
+		static void decodeAvx512(const u8 *rows, usz count, u8 *out) {
+
+			const __m512i bits = _mm512_load_si512((const void*) pixelBits);
+			const __m512i spreadLo = _mm512_load_si512((const void*) avx512Spread);
+			const __m512i spreadHi = _mm512_add_epi8(spreadLo, _mm512_set1_epi8(1));
+			const __m512i one = _mm512_set1_epi8(1), two = _mm512_set1_epi8(2);
+
+			for (usz i = 0; i < count; i += 8, rows += 16, out += 64) {
+
+				const __m512i v = _mm512_maskz_broadcast_i32x4(0xFFFF, _mm_loadu_si128((const __m128i*) rows));
+
+				const __mmask64 l = _mm512_test_epi8_mask(_mm512_shuffle_epi8(v, spreadLo), bits);
+				const __mmask64 h = _mm512_test_epi8_mask(_mm512_shuffle_epi8(v, spreadHi), bits);
+
+				_mm512_storeu_si512((void*) out, _mm512_or_si512(_mm512_maskz_mov_epi8(l, one), _mm512_maskz_mov_epi8(h, two)));
+			}
+		}
+
+		GB_TARGET("avx512f,avx512bw")
+		static void colorizeAvx512(const u8 *indices, usz count, const u32 palette[4], u32 *out) {
+
+			const __m512i colors = _mm512_maskz_broadcast_i32x4(0xFFFF, _mm_loadu_si128((const __m128i*) palette));
+
+			for (usz i = 0; i < count; i += 16) {
+				const __m512i d = _mm512_maskz_cvtepu8_epi32(0xFFFF, _mm_loadu_si128((const __m128i*)(indices + i)));
+				_mm512_storeu_si512((void*)(out + i), _mm512_maskz_permutexvar_epi32(0xFFFF, d, colors));
+			}
+		}
+
+		//CPUID; AVX needs the OS to save the registers as well
+
+		static bool supported(Isa isa) {
+
+			#ifdef _MSC_VER
+
+				int info[4];
+				__cpuid(info, 0);
+
+				const int maxLeaf = info[0];
+
+				__cpuidex(info, 1, 0);
+
+				const bool sse2 = info[3] & (1 << 26);
+				const bool osxsave = info[2] & (1 << 27);
+				const u64 xcr0 = osxsave ? _xgetbv(0) : 0;
+
+				int leaf7[4]{};
+
+				if (maxLeaf >= 7)
+					__cpuidex(leaf7, 7, 0);
+
+				switch (isa) {
+					case SSE2:		return sse2;
+					case AVX2:		return (xcr0 & 0x6) == 0x6 && (leaf7[1] & (1 << 5));
+					case AVX512:	return (xcr0 & 0xE6) == 0xE6 && (leaf7[1] & (1 << 16)) && (leaf7[1] & (1 << 30));
+					default:		return true;
+				}
+
+			#else
+
+				__builtin_cpu_init();
+
+				switch (isa) {
+					case SSE2:		return __builtin_cpu_supports("sse2");
+					case AVX2:		return __builtin_cpu_supports("avx2");
+					case AVX512:	return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw");
+					default:		return true;
+				}
+
+			#endif
+		}
+
+		static const Kernels kernels[ISA_COUNT] = {
+			{ SCALAR, "scalar", decodeScalar, colorizeScalar },
+			{ SSE2, "sse2", decodeSse2, colorizeSse2 },
+			{ AVX2, "avx2", decodeAvx2, colorizeAvx2 },
+			{ AVX512, "avx512", decodeAvx512, colorizeAvx512 }
+		};
+
+	#else
+
+		static bool supported(Isa isa) {
+			return isa == SCALAR;
+		}
+
+		static const Kernels kernels[ISA_COUNT] = {
+			{ SCALAR, "scalar", decodeScalar, colorizeScalar }
+		};
+
+	#endif
+
+	const Kernels *get(Isa isa) {
+		return isa < ISA_COUNT && kernels[isa].decode && supported(isa) ? kernels + isa : nullptr;
+	}
+
+	const Kernels &best() {
+
+		static const Kernels &selected = [] () -> const Kernels& {
+
+			for (usz i = ISA_COUNT; i-- > 0; )
+				if (const Kernels *k = get(Isa(i)))
+					return *k;
+
+			return kernels[SCALAR];
+		}();
+
+		return selected;
+	}
+
+}
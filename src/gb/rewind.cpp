@@ -0,0 +1,137 @@
+#include "gb/rewind.hpp"
+#include "gb/delta.hpp"
+#include "system/system.hpp"
+#include "system/log.hpp"
+#include <cstring>
+
+namespace gb {
+
+	//History
+
+	Rewind::Rewind(Emulator &e): Rewind(e, Info()) {}
+
+	Rewind::Rewind(Emulator &e, const Info &inf): emu(e), info(inf) {
+
+		const usz size = emu.stateSize();
+
+		if (!info.maxFrames || !info.keyframeInterval)
+			oic::System::log()->fatal("Rewind requires at least one frame and keyframe interval");
+
+		if (info.budget < 2 * delta::bound(size))
+			oic::System::log()->fatal("Rewind budget can't hold a state");
+
+		ring.resize(info.budget);
+		state.resize(size);
+		next.resize(size);
+		scratch.resize(delta::bound(size));
+		entries.resize(info.maxFrames);
+	}
+
+	//Uses saveState, so delta states taken in between are relative to the last push
+
+	void Rewind::push() {
+
+		if (count == entries.size())
+			evict();
+
+		emu.saveState(next.data(), next.size());
+
+		bool keyframe = !count || sinceKeyframe + 1 >= info.keyframeInterval;
+
+		usz size = delta::compress(next.data(), keyframe ? nullptr : state.data(), next.size(), scratch.data());
+		u8 *dst = allocate(size);
+
+		//Making room dropped the keyframe this frame depends on
+
+		if (!keyframe && !count) {
+			keyframe = true;
+			size = delta::compress(next.data(), nullptr, next.size(), scratch.data());
+			dst = allocate(size);
+		}
+
+		std::memcpy(dst, scratch.data(), size);
+
+		entry(count) = Entry{ usz(dst - ring.data()), size, keyframe };
+		++count;
+
+		end = usz(dst - ring.data()) + size;
+		sinceKeyframe = keyframe ? 0 : sinceKeyframe + 1;
+
+		state.swap(next);
+	}
+
+	//Frames from the last keyframe before it; never more than the keyframe interval
+
+	bool Rewind::stepBack(usz frames) {
+
+		if (frames >= count)
+			return false;
+
+		const usz target = count - 1 - frames;
+		usz keyframe = target;
+
+		while (!entry(keyframe).keyframe)
+			--keyframe;
+
+		std::memset(state.data(), 0, state.size());
+
+		for (usz i = keyframe; i <= target; ++i)
+			if (!delta::apply(ring.data() + entry(i).offset, entry(i).size, state.data(), state.size()))
+				return false;
+
+		count = target + 1;
+		end = entry(target).offset + entry(target).size;
+		sinceKeyframe = target - keyframe;
+
+		return emu.loadState(state.data(), state.size());
+	}
+
+	bool Rewind::stepBackSeconds(f64 seconds) {
+		return seconds >= 0 && stepBack(usz(seconds * framesPerSecond + 0.5));
+	}
+
+	void Rewind::clear() {
+		first = count = end = sinceKeyframe = 0;
+	}
+
+	usz Rewind::memoryUsed() const {
+
+		if (!count)
+			return 0;
+
+		const usz start = entry(0).offset;
+		return end > start ? end - start : ring.size() - start + end;
+	}
+
+	//The ring is filled in order, so the oldest entries are the first ones after the end (if it wrapped)
+	//Wrapping drops everything after the end, since it has to stay in order
+
+	u8 *Rewind::allocate(usz size) {
+
+		if (!count)
+			end = 0;
+
+		if (end + size > ring.size()) {
+
+			while (count && entry(0).offset >= end)
+				evict();
+
+			end = 0;
+		}
+
+		while (count && entry(0).offset >= end && entry(0).offset < end + size)
+			evict();
+
+		return ring.data() + end;
+	}
+
+	//Drop the oldest frame and the ones that depend on it, so the oldest frame is always a keyframe
+
+	void Rewind::evict() {
+		do {
+			first = (first + 1) % entries.size();
+			--count;
+		} while (count && !entry(0).keyframe);
+	}
+
+}
@@ -0,0 +1,228 @@
+#include "gb/rom_cache.hpp"
+
+#ifdef _WIN32
+	#define NOMINMAX
+	#include <Windows.h>
+#else
+	#include <fcntl.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <unistd.h>
+#endif
+
+#include <cstring>
+#include <mutex>
+#include <unordered_map>
+
+namespace gb {
+
+	//Only picks the bucket; images with the same hash are compared byte by byte
+
+	static u64 hashOf(const u8 *data, usz size) {
+
+		u64 h = 0x9E3779B97F4A7C15 ^ size;
+		usz i = 0;
+
+		for (; i + 8 <= size; i += 8) {
+			u64 v;
+			std::memcpy(&v, data + i, sizeof(v));
+			h = (h ^ v) * 0xFF51AFD7ED558CCD;
+			h ^= h >> 32;
+		}
+
+		for (; i < size; ++i)
+			h = (h ^ data[i]) * 0x100000001B3;
+
+		return h;
+	}
+
+	static std::mutex lock;
+	static std::unordered_multimap<u64, std::weak_ptr<const RomImage>> images;
+
+	//Platform file mapping
+
+	static void *mapFile(const char *path, usz &size) {
+
+		#ifdef _WIN32
+
+			HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+
+			if (file == INVALID_HANDLE_VALUE)
+				return nullptr;
+
+			LARGE_INTEGER length{};
+			void *view{};
+
+			if (GetFileSizeEx(file, &length) && length.QuadPart > 0) {
+
+				if (HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr)) {
+					view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+					CloseHandle(mapping);
+				}
+			}
+
+			CloseHandle(file);
+
+			size = usz(length.QuadPart);
+			return view;
+
+		#else
+
+			const int file = ::open(path, O_RDONLY);
+
+			if (file < 0)
+				return nullptr;
+
+			struct stat info{};
+			void *view{};
+
+			if (!fstat(file, &info) && info.st_size > 0) {
+
+				view = mmap(nullptr, usz(info.st_size), PROT_READ, MAP_SHARED, file, 0);
+
+				if (view == MAP_FAILED)
+					view = nullptr;
+			}
+
+			::close(file);
+
+			size = usz(info.st_size);
+			return view;
+
+		#endif
+	}
+
+	static void unmapFile(void *view, usz size) {
+
+		#ifdef _WIN32
+			(void) size;
+			UnmapViewOfFile(view);
+		#else
+			munmap(view, size);
+		#endif
+	}
+
+	RomImage::~RomImage() {
+		if (view)
+			unmapFile(view, viewLength);
+	}
+
+	//Must be called with the lock held
+
+	static std::shared_ptr<const RomImage> find(const u8 *data, usz size, usz content, u64 key) {
+
+		const auto range = images.equal_range(key);
+
+		for (auto it = range.first; it != range.second; ++it)
+			if (auto image = it->second.lock())
+				if (image->size() == size && image->contentSize() == content && !std::memcmp(image->data(), data, size))
+					return image;
+
+		return nullptr;
+	}
+
+	static std::shared_ptr<const RomImage> insert(const std::shared_ptr<const RomImage> &image) {
+
+		for (auto it = images.begin(); it != images.end(); )
+			it = it->second.expired() ? images.erase(it) : ++it;
+
+		images.emplace(image->hash(), image);
+		return image;
+	}
+
+	//Pads a copy to a whole number of banks
+
+	static _inline_ usz paddedSize(usz size) {
+		return (size + RomCache::alignment - 1) / RomCache::alignment * RomCache::alignment;
+	}
+
+	std::shared_ptr<const RomImage> RomCache::get(const Buffer &buffer) {
+
+		if (buffer.empty())
+			return nullptr;
+
+		const usz size = paddedSize(buffer.size());
+
+		Buffer padded;
+		const u8 *data = buffer.data();
+
+		if (size != buffer.size()) {
+			padded.assign(buffer.begin(), buffer.end());
+			padded.resize(size);
+			data = padded.data();
+		}
+
+		const u64 key = hashOf(data, size);
+
+		std::lock_guard<std::mutex> guard(lock);
+
+		if (auto image = find(data, size, buffer.size(), key))
+			return image;
+
+		auto image = std::make_shared<RomImage>();
+
+		if (padded.size())
+			image->copy = std::move(padded);
+
+		else image->copy = buffer;
+
+		image->ptr = image->copy.data();
+		image->length = size;
+		image->content = buffer.size();
+		image->key = key;
+
+		return insert(image);
+	}
+
+	//A file that isn't a whole number of banks would be read past its end, so it's copied instead
+
+	std::shared_ptr<const RomImage> RomCache::open(const char *path) {
+
+		usz fileSize{};
+		void *view = mapFile(path, fileSize);
+
+		if (!view)
+			return nullptr;
+
+		auto image = std::make_shared<RomImage>();
+		image->view = view;
+		image->viewLength = fileSize;
+
+		if (fileSize % alignment) {
+			image->copy.resize(paddedSize(fileSize));
+			std::memcpy(image->copy.data(), view, fileSize);
+			image->ptr = image->copy.data();
+		}
+
+		else image->ptr = (const u8*) view;
+
+		image->length = paddedSize(fileSize);
+		image->content = fileSize;
+		image->key = hashOf(image->ptr, image->length);
+
+		std::lock_guard<std::mutex> guard(lock);
+
+		if (auto existing = find(image->ptr, image->length, image->content, image->key))
+			return existing;
+
+		if (image->copy.size()) {
+			unmapFile(image->view, image->viewLength);
+			image->view = nullptr;
+		}
+
+		return insert(image);
+	}
+
+	usz RomCache::size() {
+
+		std::lock_guard<std::mutex> guard(lock);
+
+		usz count{};
+
+		for (auto &entry : images)
+			count += !entry.second.expired();
+
+		return count;
+	}
+
+}